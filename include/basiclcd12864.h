@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <delay.h> // From the include path, so host builds can substitute their own
+#include "framebuf.h"
+#include "gdramplan.h"
+#include "lcd12864.h"
+#include "util.h"
+
+namespace lcd {
+
+    /*
+     * LCD12864 on any bus, chosen at compile time.
+     *
+     * Sends exactly the same commands as LCD12864 on the 8-bit interface, through plan_gdram_update() for the
+     * drawing updates. The bus provides write_cmd(), write_data() and write_cmd_no_wait() like LCDBase, plus
+     * send_writes() to start sending a list of writes and is_sending() to tell when they're done. How the writes
+     * get to the LCD is entirely up to the bus, so the code using this doesn't depend on the transport.
+     */
+    template <typename Bus>
+    class BasicLCD12864 : public Bus {
+        typedef LCD12864::Command Command;
+
+    public:
+        // All arguments go to the bus
+        template <typename... Args>
+        BasicLCD12864(Args... args) : Bus(args...) {}
+
+        void init() {
+            delay::ms(15);
+            this->write_cmd_no_wait(Command::NORMAL_CMD_8BIT);
+            delay::ms(5);
+            this->write_cmd_no_wait(Command::NORMAL_CMD_8BIT);
+            delay::ms(5);
+
+            this->write_cmd(Command::ENTRY_CURSOR_SHIFT_RIGHT);
+            this->write_cmd(Command::CLEAR);
+            this->write_cmd(Command::DISPLAY_ON_CURSOR_OFF);
+        }
+        void write_str(const char *str) {
+            for (uint16_t i = 0; str[i] != '\0'; i ++) {
+                this->write_data(str[i]);
+            }
+        }
+        void printf(const char *fmt, ...) {
+            char buf[LCD_PRINTF_BUFFER_SIZE] = { 0 };
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(buf, LCD_PRINTF_BUFFER_SIZE, fmt, args);
+            va_end(args);
+            write_str(buf);
+        }
+
+        void clear() {
+            this->write_cmd(Command::CLEAR);
+        }
+        void home() {
+            this->write_cmd(Command::HOME);
+        }
+        void set_cursor(uint8_t row, uint8_t col) {
+            static const uint8_t ROW_ADDRESS[4] = { 0x80, 0x90, 0x88, 0x98 };
+            if (row < 4) {
+                col += ROW_ADDRESS[row];
+            }
+            col |= 0x80;
+            col &= 0xBF;
+            // The address can only be set with the basic instruction set
+            bool was_extended = extended;
+            use_basic();
+            this->write_cmd(col);
+            if (was_extended) {
+                use_extended();
+            }
+        }
+
+        bool is_using_extended() {
+            return extended;
+        }
+        void use_extended() {
+            if (extended) {
+                return;
+            }
+            this->write_cmd(Command::EXT_CMD_8BIT);
+            extended = true;
+        }
+        void use_basic() {
+            if (!extended) {
+                return;
+            }
+            this->write_cmd(Command::NORMAL_CMD_8BIT);
+            extended = false;
+        }
+
+        bool is_drawing() {
+            return drawing;
+        }
+        void start_draw() {
+            use_extended();
+            this->write_cmd(Command::EXT_GRAPHICS_ON_8BIT);
+            drawing = true;
+        }
+        void end_draw() {
+            this->write_cmd(Command::EXT_GRAPHICS_OFF_8BIT);
+            drawing = false;
+        }
+
+        void clear_drawing() {
+            if (!drawing) {
+                return;
+            }
+            // Including the rows that are off screen, since they can be scrolled in
+            for (uint8_t row = 0; row < 64; row ++) {
+                for (uint8_t col = 0; col < 16; col ++) {
+                    NoInterrupt noi;
+                    this->write_cmd(0x80 | row);
+                    this->write_cmd(0x80 | col);
+                    this->write_data(0x00);
+                    this->write_data(0x00);
+                }
+            }
+            memset(display_buf.ram, 0, sizeof(display_buf.ram));
+            memset(draw_buf, 0, sizeof(draw_buf));
+        }
+
+        // Only compare and rewrite the GDRAM words marked in dirty
+        void update_drawing(const framebuf::DirtyMask &dirty) {
+            start_update_drawing(dirty);
+            while (is_updating()) {}
+        }
+        // Same as update_drawing(), but returns as soon as the bus has started sending, if it can send in the
+        // background; no other operations may be done on the LCD until is_updating() returns false
+        void start_update_drawing(const framebuf::DirtyMask &dirty) {
+            if (!drawing) {
+                return;
+            }
+            while (is_updating()) {}
+            uint16_t count = plan_gdram_update(draw_buf, display_buf, scroll, dirty, gdram_writes, bus_cost, &bus_stats);
+            this->send_writes(gdram_writes, count);
+        }
+        bool is_updating() {
+            return this->is_sending();
+        }
+
+        // Move what's on screen up by lines rows (down if negative) with the hardware scroll on the next update
+        void scroll_by(int8_t lines) {
+            scroll = (scroll + lines) & 63;
+        }
+
+        void set_bus_cost(const BusCost &cost) {
+            bus_cost = cost;
+        }
+        const BusStats& get_bus_stats() {
+            return bus_stats;
+        }
+        void reset_bus_stats() {
+            bus_stats = {};
+        }
+
+        // The image that will be displayed after the next update
+        framebuf::Frame draw_buf = {0};
+
+    protected:
+        bool extended = false;
+        bool drawing = false;
+
+        GDRAMState display_buf = {};
+        uint8_t scroll = 0;
+        BusWrite gdram_writes[MAX_GDRAM_WRITES];
+        BusCost bus_cost = DEFAULT_BUS_COST;
+        BusStats bus_stats = {};
+    };
+} // namespace lcd
@@ -1,20 +1,81 @@
 #pragma once
 
 #include <stdint.h>
+#include "framebuf.h"
+#include "videoformat.h"
 
 extern "C" const uint8_t viddata[];
 extern "C" const uint32_t viddata_size;
 
 class VideoDecoder {
 
-    uint32_t byte_idx = 0;
-    uint8_t bit_idx = 8;
+    // The video data must be word aligned and readable up to the next word boundary past its end
+    const uint8_t * const data;
+    const uint32_t data_size;
 
+    // Index of the next word to load into the cache
+    uint32_t word_idx = 0;
+    // The next bits to be read, starting from the most significant bit
+    // Bits past the number available are always 0
+    uint32_t cache = 0;
+    uint8_t cache_bits = 0;
+
+    // The container header (see videoformat.h)
+    // Filled in while HEADER_SIZE is initialized, so everything after it can be derived from it
+    video::Header format;
+    const uint8_t HEADER_SIZE;
     const uint8_t FRAME_WIDTH, FRAME_HEIGHT;
+    const bool SCROLL_OPS;
+    const bool HUFFMAN_RUNS;
+    const bool RANS_CODED;
     const uint8_t FRAME_OFFSET_X, FRAME_OFFSET_Y;
+    const uint8_t CHUNK_COUNT_X, CHUNK_COUNT_Y, CHUNK_COUNT;
     const uint8_t CHUNK_WIDTH, CHUNK_HEIGHT;
+    const uint8_t GROUP_SIZE;
+    video::RepeatOffsets repeat_offsets;
+    // A video only uses one of these, so they share the space
+    union {
+        // Run length code lookup, with HUFFMAN_RUNS: the entry for the next MAX_RUN_CODE_LENGTH bits of video data
+        // is the symbol of the code they start with, shifted up by 4, and the length of the code
+        uint16_t run_table[1 << video::MAX_RUN_CODE_LENGTH];
+        // Run symbol of every rANS slot, with RANS_CODED
+        uint8_t rans_symbols[video::RANS_SCALE];
+    };
+    // First slot of every run symbol
+    uint16_t rans_run_starts[video::RUN_SYMBOLS];
+    void build_run_table();
+    void build_rans_tables();
+
+    // rANS coder state, and the last frame's chunk mask for picking the models of the next one
+    uint32_t rans_state = 0;
+    uint64_t rans_last_mask = 0;
+
+    // Number of frames read so far
+    uint32_t frame_idx = 0;
+
+    // GDRAM words touched by the last frame
+    framebuf::DirtyMask dirty = {0};
+    // Rows the last frame scrolled up by (down if negative)
+    int8_t scroll = 0;
+
+    // Move the picture within the frame area up by lines rows (down if negative)
+    // Rows that nothing moves into are left alone
+    void scroll_frame(framebuf::Frame frame, int8_t lines);
 
-    bool first_frame = true;
+    // Load the next word of video data into the cache
+    // The cache must be empty
+    void refill();
+
+    // Number of bits left in the video data
+    uint32_t bits_left() const;
+
+    // Drop bits that have been read from the cache
+    void consume(uint8_t count);
+
+    // Skip to the next byte boundary, where keyframes start
+    void align();
+    // Carry on reading from byte offset of the video data
+    void move_to(uint32_t offset);
 
     // Read the next bit from the video data
     // Does not perform range checks
@@ -24,29 +85,78 @@ class VideoDecoder {
     // Performs a range check; returns false if there is not enough data
     template <typename T>
     bool read_bits(uint8_t count, T &out) {
+        if (bits_left() < count) {
+            return false;
+        }
         out = 0;
-        for (uint8_t i = 0; i < count; i ++) {
-            out = out << 1 | read_bit();
-            // Check if we've gone past the end
-            if (byte_idx >= viddata_size && i < count - 1) {
-                return false;
-            }
+        while (count > 32) {
+            out = out << 32 | read_bits(32);
+            count -= 32;
         }
+        out = out << count | read_bits(count);
         return true;
     }
     // The no-range-check version of the other one
-    uint64_t read_bits(uint8_t count);
+    // Reads at most 32 bits
+    uint32_t read_bits(uint8_t count);
+    // The next count bits of video data, without reading them (1 <= count <= 32)
+    uint32_t peek_bits(uint8_t count) const;
 
     // Read a bit repeat count from the video data
     // Does not perform range checks (relies on frame headers being at least 8 bits long)
     uint16_t read_repeat_count();
+    // Same, for each of the run length codes
+    uint16_t read_grouped_repeat_count();
+    uint16_t read_huffman_repeat_count();
+    uint16_t read_rans_repeat_count();
+
+    // Start a new rANS stream at a keyframe
+    void rans_start();
+    // Take the symbol at [start, start + freq) out of the rANS state, and top it back up from the video data
+    // Like read_repeat_count(), does not perform range checks (relies on the frame count)
+    void rans_advance(uint16_t start, uint16_t freq);
+    // Read a value with one of the binary models, or count raw bits (count <= RANS_SCALE_BITS)
+    bool rans_bit(uint8_t model);
+    uint16_t rans_raw(uint8_t count);
 
 public:
 
-    VideoDecoder();
+    VideoDecoder(const uint8_t *data, uint32_t size);
+
+    // Whether the video has a header this decoder understands
+    // If not, read_frame() always returns false
+    bool is_supported() const;
+    const video::Header& get_header() const {
+        return format;
+    }
+
+    // Number of the frame the next call to read_frame() reads
+    uint32_t next_frame() const {
+        return frame_idx;
+    }
+    // Whether the video has a keyframe index
+    bool can_seek() const;
+    // Go to the last keyframe at or before frame, so it's the next one read
+    // The frames from there up to frame have to be read to get to frame itself; there are fewer than the
+    // keyframe interval of them
+    // Returns false if there is no index, in which case nothing changes
+    bool seek(uint32_t frame);
 
-    bool read_frame(uint8_t frame[64][16], uint64_t header);
+    // Scroll the frame (see scrolled_lines()), then update the chunks in header
+    bool read_frame(framebuf::Frame frame, uint64_t header, int8_t lines = 0);
     // Read a frame and update the frame buffer
-    // Returns false if there is no more data
-    bool read_frame(uint8_t frame[64][16]);
+    // Returns false if there is no more data, or the video's frame count has been reached
+    bool read_frame(framebuf::Frame frame);
+
+    // The GDRAM words that the last call to read_frame() may have changed
+    // Only these need to be compared when updating the display
+    const framebuf::DirtyMask& changed_words() const {
+        return dirty;
+    }
+
+    // Number of screen rows the picture was moved up by before the last frame's changes were applied
+    // Negative if it moved down; the display can do this with its scroll address instead of redrawing
+    int8_t scrolled_lines() const {
+        return scroll;
+    }
 };
@@ -2,8 +2,15 @@
 
 #include "stm32f10x.h"
 
+#define SYSCLK_FREQUENCY 72 // MHz
+
 namespace delay {
 	void cycles(uint32_t);
+	// Start the DWT cycle counter, which counts up at the system clock and wraps every ~60s
+	void init_cycle_counter();
+	inline uint32_t cycle_count() {
+		return *reinterpret_cast<volatile uint32_t *>(0xE0001004); // DWT_CYCCNT
+	}
 	void sec(uint16_t s);
 	void ms(uint16_t ms);
 	void us(uint16_t us);
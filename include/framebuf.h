@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Layout of the 128x64 monochrome frame buffer shared by the decoder and the LCD driver.
+ *
+ * Every screen row is 16 consecutive bytes, MSB first, in both layouts; what differs is the order of the rows.
+ * By default the rows are stored top to bottom. If FRAMEBUF_GDRAM_LAYOUT is defined, the buffer is stored in
+ * the ST7920's GDRAM order instead: 32 rows of 16 words, where words 0-7 are the top half of the screen and
+ * words 8-15 the bottom half, so GDRAM row r holds screen rows r and r + 32.
+ */
+namespace framebuf {
+
+    constexpr uint8_t WIDTH = 128;
+    constexpr uint8_t HEIGHT = 64;
+
+#ifdef FRAMEBUF_GDRAM_LAYOUT
+    constexpr uint8_t ROWS = 32;
+    constexpr uint8_t ROW_BYTES = 32;
+#else
+    constexpr uint8_t ROWS = 64;
+    constexpr uint8_t ROW_BYTES = 16;
+#endif
+
+    typedef uint8_t Frame[ROWS][ROW_BYTES];
+
+    // Byte offset of the start of screen row y
+    constexpr uint16_t row_offset(uint8_t y) {
+#ifdef FRAMEBUF_GDRAM_LAYOUT
+        return (y % 32) * ROW_BYTES + (y / 32) * 16;
+#else
+        return y * ROW_BYTES;
+#endif
+    }
+
+    // Offset between screen rows y and y + 1, as long as both are in the same half of the screen
+    constexpr uint8_t ROW_STRIDE = ROW_BYTES;
+
+    // Byte offset of the high byte of GDRAM word col in GDRAM row row
+    constexpr uint16_t word_offset(uint8_t row, uint8_t col) {
+#ifdef FRAMEBUF_GDRAM_LAYOUT
+        return row * ROW_BYTES + col * 2;
+#else
+        return row_offset(col >= 8 ? row + 32 : row) + (col % 8) * 2;
+#endif
+    }
+
+    // Set of GDRAM words that may have changed since the last update
+    // Bit col of entry row is set if word col of GDRAM row row may be different
+    typedef uint16_t DirtyMask[32];
+
+    // Mask of the words in one half of a GDRAM row (bits 0-7) that cover pixel columns [x0, x1)
+    constexpr uint8_t word_span(uint8_t x0, uint8_t x1) {
+        return x1 <= x0 ? 0 : (0xFF >> (7 - (x1 - 1) / 16)) & (0xFF << (x0 / 16));
+    }
+
+    // Mark the words selected by span (see word_span) dirty on screen rows [y0, y1)
+    inline void mark_dirty(DirtyMask dirty, uint8_t y0, uint8_t y1, uint8_t span) {
+        for (uint8_t y = y0; y < y1; y ++) {
+            dirty[y % 32] |= span << (y / 32 * 8);
+        }
+    }
+
+    // Pointer to the byte containing pixel (x, y)
+    inline uint8_t* pixel_byte(Frame frame, uint8_t x, uint8_t y) {
+        return &frame[0][0] + row_offset(y) + x / 8;
+    }
+} // namespace framebuf
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "gdramplan.h"
+#include "lcdbase.h"
+
+namespace lcd {
+
+    /*
+     * Sends planned GDRAM writes to the LCD in the background.
+     *
+     * TIM1 paces the writes, one every LCD_EXEC_TIME microseconds so the busy flag never needs to be checked.
+     * Its four compare channels go off 1-4us into every period, and each requests a DMA transfer to a GPIO BSRR:
+     * CC1 and CC2 put the data byte and RS on (up to) two ports, then CC3 raises E and CC4 lowers it to latch
+     * the write. The transfer complete interrupt of the CC4 channel marks the end.
+     *
+     * Only the 8-bit interface, with the data pins and RS on at most two ports, is supported.
+     */
+    class GDRAMDMA {
+    public:
+        GDRAMDMA(LCDBase &lcd);
+
+        // Whether the LCD's pin assignment can be driven by this engine
+        bool is_supported() const;
+        bool is_busy() const;
+
+        // Start sending the writes
+        // The engine must be supported and not busy
+        void start(const BusWrite *writes, uint16_t count);
+
+        // Called from the DMA interrupt when the last write has been latched
+        void complete();
+
+    private:
+        LCDBase &lcd;
+
+        // A GPIO port written by the CC1 or CC2 channel
+        struct PortStream {
+            GPIO_TypeDef *port;
+            // BSRR tables of the data pins on this port, if there are any
+            const LCDBase::DataPortTable *table;
+            // BSRR bits for RS high and low, if RS is on this port
+            uint32_t rs_high;
+            uint32_t rs_low;
+            // BSRR bits for E low, if E is on this port
+            uint32_t e_low;
+        };
+        PortStream streams[2];
+        uint8_t stream_count = 0;
+        bool supported = false;
+
+        // BSRR words for each write, one array per port
+        uint32_t words[2][MAX_GDRAM_WRITES];
+        // Constant BSRR words that raise and lower E
+        uint32_t e_high_word;
+        uint32_t e_low_word;
+
+        bool hardware_ready = false;
+        volatile bool busy = false;
+
+        void init_hardware();
+        PortStream* stream_for(GPIO_TypeDef *port);
+    };
+} // namespace lcd
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include "framebuf.h"
+
+namespace lcd {
+
+    // One write on the LCD bus
+    struct BusWrite {
+        uint8_t value;
+        // Data write (RS high) if true, command otherwise
+        bool data;
+    };
+
+    // Most writes a GDRAM update can take: an address and 16 words for every row, then the scroll commands
+    constexpr uint16_t MAX_GDRAM_WRITES = 32 * (2 + 16 * 2) + 2;
+
+    /*
+     * What the ST7920 is showing: all 64 rows of its GDRAM, and the vertical scroll address.
+     *
+     * Only 32 rows are on screen at a time. Screen row y of the top half shows words 0-7 of GDRAM row
+     * (y + scroll) % 64, and screen row y + 32 of the bottom half shows words 8-15 of the same GDRAM row,
+     * so scrolling moves both halves of the screen through their own 64-row ring.
+     */
+    struct GDRAMState {
+        // Same byte order as a GDRAM layout frame buffer
+        uint8_t ram[64][32];
+        uint8_t scroll;
+        // Vertical scroll has to be enabled once before the scroll address does anything
+        bool scroll_enabled;
+    };
+
+    // Relative cost of a command and a data write, e.g. their execution times
+    struct BusCost {
+        uint16_t command;
+        uint16_t data;
+    };
+    // Every write takes LCD_EXEC_TIME on the ST7920, whether it's a command or data
+    constexpr BusCost DEFAULT_BUS_COST = { 1, 1 };
+
+    // Number of writes made by one or more updates
+    struct BusStats {
+        uint32_t commands;
+        uint32_t data;
+    };
+
+    /*
+     * Plan the writes that bring the GDRAM from display up to date with draw, scrolled by scroll rows.
+     *
+     * Only the words marked in dirty are compared, unless the scroll address changes, in which case every word is.
+     * Changed words are copied into display, and the commands and data that write them are put in writes, which
+     * must have room for MAX_GDRAM_WRITES. The extended instruction set must be active when the writes are sent.
+     * Returns the number of writes.
+     *
+     * Setting the address takes two commands, since the vertical and horizontal addresses are set separately.
+     * When the changed words in a row are separated by a gap of unchanged ones, the gap is either skipped by
+     * setting the address again, or bridged by rewriting the unchanged words, whichever costs less according to
+     * cost. Rows always need their own address, since only the horizontal address increments.
+     *
+     * When the picture moves vertically, changing the scroll address moves most of it for two commands, and only
+     * the rows that scrolled into view (and the ones that crossed the middle of the screen) still differ. The
+     * scroll address is set after the words are written, so the new rows are mostly written while off screen.
+     *
+     * The writes are added to stats if it's not null.
+     *
+     * This doesn't touch the hardware, so it can be run and checked on the host.
+     */
+    uint16_t plan_gdram_update(const framebuf::Frame draw, GDRAMState &display, uint8_t scroll,
+            const framebuf::DirtyMask &dirty, BusWrite *writes, const BusCost &cost = DEFAULT_BUS_COST,
+            BusStats *stats = nullptr);
+} // namespace lcd
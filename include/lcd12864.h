@@ -1,5 +1,8 @@
 #pragma once
 
+#include "framebuf.h"
+#include "gdramdma.h"
+#include "gdramplan.h"
 #include "lcdbase.h"
 #include <string.h>
 
@@ -12,11 +15,11 @@ namespace lcd {
     public:
         LCD12864(GPIOPin RS, GPIOPin RW, GPIOPin E, GPIOPin D0, GPIOPin D1, GPIOPin D2, GPIOPin D3, GPIOPin D4,
                 GPIOPin D5, GPIOPin D6, GPIOPin D7, uint32_t timeout = 1000000)
-                : LCDBase(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7, timeout) {
+                : LCDBase(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7, timeout), dma(*this) {
         }
         LCD12864(GPIOPin RS, GPIOPin RW, GPIOPin E, GPIOPin D4, GPIOPin D5, GPIOPin D6, GPIOPin D7,
                 uint32_t timeout = 1000000)
-                : LCDBase(RS, RW, E, D4, D5, D6, D7, timeout) {
+                : LCDBase(RS, RW, E, D4, D5, D6, D7, timeout), dma(*this) {
         }
 
         // Override LCDBase
@@ -78,9 +81,28 @@ namespace lcd {
 
         void clear_drawing();
         void update_drawing();
+        // Only compare and rewrite the GDRAM words marked in dirty
+        void update_drawing(const framebuf::DirtyMask &dirty);
+        // Same as update_drawing(), but the writes are sent by DMA in the background, so this returns right away
+        // draw_buf can be changed as soon as this returns, but no other operations may be done on the LCD until
+        // is_updating() returns false
+        // Falls back to a blocking update if the pins can't be driven by DMA
+        void start_update_drawing(const framebuf::DirtyMask &dirty);
+        bool is_updating();
+
+        // Move what's on screen up by lines rows (down if negative) with the hardware scroll on the next update
+        // Only the rows that scroll in have to be written, as long as draw_buf has moved the same way
+        void scroll_by(int8_t lines);
+
+        // Cost model used to decide when to bridge gaps between changed words (see gdramplan.h)
+        void set_bus_cost(const BusCost &cost);
+        // Writes made by all drawing updates so far
+        const BusStats& get_bus_stats();
+        void reset_bus_stats();
 
         // The image that will be displayed after the next update
-        uint8_t draw_buf[64][16] = {0};
+        // See framebuf.h for the layout
+        framebuf::Frame draw_buf = {0};
 
     protected:
         bool extended = false;
@@ -88,7 +110,15 @@ namespace lcd {
 
         // Stores what's currently being displayed
         // When updating, this is compared with draw_buf so no unnecessary writes are made
-        uint8_t display_buf[64][16] = {0};
+        GDRAMState display_buf = {};
+        // Scroll address for the next update
+        uint8_t scroll = 0;
+
+        // Writes planned for the current update
+        BusWrite gdram_writes[MAX_GDRAM_WRITES];
+        BusCost bus_cost = DEFAULT_BUS_COST;
+        BusStats bus_stats = {};
+        GDRAMDMA dma;
     };
 } // namespace lcd
 
@@ -1,13 +1,31 @@
 #pragma once
 
 #include "gpiopin.h"
+#include "lcdqueue.h"
 #include "stm32f10x.h"
 
 #define LCD_ENABLE_DELAY 10        // Cycles
+#define LCD_EXEC_TIME 72           // Microseconds; worst case for most instructions and RAM reads/writes
+#define LCD_CLEAR_EXEC_TIME 1600   // Microseconds; worst case for clear and home
 #define LCD_PRINTF_BUFFER_SIZE 128 // Characters
 
 namespace lcd {
 
+    // Worst-case execution time of a write, in microseconds, given the instruction set it is sent in
+    inline uint16_t exec_time(uint8_t value, bool data, bool extended) {
+        // Clear and home take much longer than everything else
+        // In the extended instruction set the same codes are standby and scroll/IRAM select, which don't
+        return !data && !extended && value < 0x04 ? LCD_CLEAR_EXEC_TIME : LCD_EXEC_TIME;
+    }
+
+    // The instruction set the controller is in after a write
+    // Only function set (001x xxxx) changes it; bit 2 (RE) selects the extended set
+    inline bool next_instruction_set(uint8_t value, bool data, bool extended) {
+        return !data && (value & 0xE0) == 0x20 ? (value & 0x04) != 0 : extended;
+    }
+
+    class GDRAMDMA;
+
     class LCDBase {
     public:
         LCDBase(GPIOPin RS, GPIOPin RW, GPIOPin E, GPIOPin D0, GPIOPin D1, GPIOPin D2, GPIOPin D3, GPIOPin D4,
@@ -30,6 +48,26 @@ namespace lcd {
         virtual uint32_t get_timeout();
         virtual void set_timeout(uint32_t);
 
+        // In timed mode the busy flag is not polled; instead, each operation waits out whatever is left of the
+        // worst-case execution time of the previous one, as measured by the cycle counter
+        bool is_timed_mode();
+        void set_timed_mode(bool);
+
+        // In queued mode, writes are sent by an interrupt from a queue (see lcdqueue.h) instead of directly, so
+        // interrupts are never masked while waiting for the controller
+        // The blocking operations still wait for their write to be done
+        bool is_queued_mode();
+        void set_queued_mode(bool);
+        // Queue a command or data write and return without waiting for it to be sent
+        // Returns false if the queue is full; blocks like write_cmd() and write_data() outside queued mode
+        bool queue_cmd(uint8_t);
+        bool queue_data(uint8_t);
+        // Wait until every queued write is done
+        void flush();
+        const LCDQueue::Stats& get_queue_stats();
+        // Number of queued writes that haven't been sent yet
+        uint16_t get_queue_depth();
+
         virtual void write_cmd(uint8_t);
         virtual void write_data(uint8_t);
         virtual uint8_t read_data();
@@ -43,8 +81,24 @@ namespace lcd {
 
         virtual void wait_busy();
 
+        bool timed_mode = false;
+        // Cycle count at which the controller will be ready again, in timed mode
+        uint32_t ready_time = 0;
+        // Wait until the controller can accept an operation, using the busy flag or the timer
+        void wait_ready();
+        // Record that the controller is busy for the specified time, in timed mode
+        void set_busy_for(uint16_t us);
+        // Whether the controller is in the extended instruction set, as of the last write sent
+        bool extended_set = false;
+
         virtual void write_cmd_no_wait(uint8_t);
 
+        // Put a byte on the bus and strobe E, without waiting for the controller
+        void send(uint8_t value, bool data);
+
+        bool queued_mode = false;
+        LCDQueue queue{*this};
+
         virtual void set_data_port(uint8_t);
         virtual uint8_t read_data_port();
 
@@ -55,8 +109,35 @@ namespace lcd {
         static const GPIOConfig READ_CONFIG;
         static const GPIOConfig WRITE_CONFIG;
 
+        // Precomputed BSRR words for the data pins on one GPIO port
+        // A byte is written with one store per port: low[data & 0x0F] | high[data >> 4]
+        struct DataPortTable {
+            GPIO_TypeDef *port;
+            uint32_t low[16];
+            uint32_t high[16];
+            // The data pins on this port, and their configuration fields in CRL and CRH
+            uint16_t pins;
+            uint32_t crl_mask;
+            uint32_t crh_mask;
+        };
+        DataPortTable data_ports[8];
+        uint8_t data_port_count = 0;
+        // Configuration fields of D7 in CRL and CRH, for switching it while polling the busy flag
+        uint32_t busy_crl_mask;
+        uint32_t busy_crh_mask;
+
+        // Switch pins to a mode with masked writes to CRL and CRH
+        // Does the same as GPIO_Init, except the clock must already be enabled
+        static void set_pins_mode(GPIO_TypeDef *port, uint16_t pins, uint32_t crl_mask, uint32_t crh_mask,
+                const GPIOConfig &config);
+
+        // Drives the pins directly when sending GDRAM updates in the background
+        friend class GDRAMDMA;
+        friend class LCDQueue;
+
     private:
         void init_GPIO();
+        void init_data_ports();
     };
 } // namespace lcd
 
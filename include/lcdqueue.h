@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include "gdramplan.h"
+
+// Number of writes the queue can hold; must be a power of 2
+#define LCD_QUEUE_SIZE 256
+
+namespace lcd {
+
+    class LCDBase;
+
+    /*
+     * Queue of LCD bus writes, sent by an interrupt at the pace of the controller.
+     *
+     * The main program is the only producer and the TIM4 interrupt the only consumer, so the ring needs no
+     * locking: the producer only moves the tail and the interrupt only moves the head. Each interrupt sends one
+     * write and sets the timer to go off again once the controller is done with it, so the busy flag is never
+     * polled and interrupts are never masked while waiting on the bus.
+     */
+    class LCDQueue {
+    public:
+        LCDQueue(LCDBase &lcd) : lcd(lcd) {}
+
+        struct Stats {
+            // Most writes that were waiting at once
+            uint16_t max_depth;
+            // Number of times a write was added to a full queue
+            uint32_t stalls;
+            // Number of writes sent
+            uint32_t sent;
+        };
+
+        // Add a write without blocking
+        // Returns false (and counts a stall) if the queue is full
+        bool try_push(BusWrite write);
+        // Add a write, waiting for room if the queue is full
+        void push(BusWrite write);
+        // Wait until every queued write has been sent and executed
+        void flush();
+        // Both of these can be called with interrupts masked; they then send the writes themselves
+
+        // Number of writes waiting to be sent
+        uint16_t depth() const;
+        bool is_idle() const;
+        const Stats& get_stats() const;
+        void reset_stats();
+
+        // Called from the timer interrupt
+        void service();
+
+    private:
+        LCDBase &lcd;
+
+        BusWrite ring[LCD_QUEUE_SIZE];
+        // Index of the next write to send; only moved by the interrupt
+        volatile uint16_t head = 0;
+        // Index past the last queued write; only moved by the producer
+        volatile uint16_t tail = 0;
+        // Whether the interrupt is sending writes or waiting for the last one to execute
+        volatile bool running = false;
+
+        Stats stats = {};
+        bool hardware_ready = false;
+
+        void init_hardware();
+        bool enqueue(BusWrite write);
+        // Start the interrupt if it's not already running
+        void kick();
+        // Let the interrupt make progress: sleep until it has run, or do its work in its place if the caller has
+        // interrupts masked
+        // Must be called with interrupts masked, after checking that there is something to wait for
+        void wait_for_service(bool caller_masked);
+    };
+} // namespace lcd
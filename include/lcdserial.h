@@ -0,0 +1,74 @@
+#pragma once
+
+#include "basiclcd12864.h"
+#include "gdramplan.h"
+#include "gpiopin.h"
+#include "serialencode.h"
+#include "stm32f10x.h"
+
+namespace lcd {
+
+    // SCLK, in kHz; the ST7920 takes up to about 1.6MHz at 2.7V
+    constexpr uint16_t SERIAL_CLOCK_KHZ = 1125;
+    // Time to shift out one byte, in us, rounded up
+    constexpr uint16_t SERIAL_BYTE_TIME = (8000 + SERIAL_CLOCK_KHZ - 1) / SERIAL_CLOCK_KHZ;
+    // Time between the bytes of an update, in us, so the writes are LCD_EXEC_TIME apart
+    constexpr uint16_t SERIAL_BYTE_PERIOD = (LCD_EXEC_TIME + SERIAL_BYTES_PER_WRITE - 1) / SERIAL_BYTES_PER_WRITE;
+    static_assert(SERIAL_BYTE_TIME < SERIAL_BYTE_PERIOD, "Every byte must be sent before the next one is due");
+
+    /*
+     * LCD bus for the ST7920's 3-wire serial mode, driven by a hardware SPI and DMA.
+     *
+     * PSB must be tied low to select serial mode. SCLK (the E pin) and SID (the RW pin) go to the SPI's SCK and
+     * MOSI: PA5 and PA7 for SPI1, PB13 and PB15 for SPI2. CS (the RS pin) can be any GPIO; it's held high.
+     *
+     * A 24-bit write takes about 21us to send, much less than LCD_EXEC_TIME, so writes have to be paced. An update
+     * is sent by DMA without the CPU, one byte every SERIAL_BYTE_PERIOD as TIM1 requests them, which puts the
+     * writes LCD_EXEC_TIME apart. The largest update (MAX_GDRAM_WRITES, 1090 writes) then takes 78.5ms, which is
+     * just inside the 83ms between frames at 12fps; the bus can't keep up with full updates at higher frame rates.
+     * TIM1 is shared with GDRAMDMA, which only drives the parallel bus, so the two are never used together.
+     *
+     * The serial mode is write-only, so there is no busy flag or read_data(). The bus keeps track of when the
+     * controller will be ready instead.
+     */
+    class SerialLCDBus {
+    public:
+        SerialLCDBus(SPI_TypeDef *spi, GPIOPin CS);
+
+        void write_cmd(uint8_t);
+        void write_data(uint8_t);
+
+        // Called from the DMA interrupt when the last byte has been handed to the SPI
+        void complete();
+
+    protected:
+        // The busy flag can't be read in serial mode, so this is the same as write_cmd()
+        void write_cmd_no_wait(uint8_t);
+
+        // Start sending writes from a plan by DMA
+        void send_writes(const BusWrite *writes, uint16_t count);
+        bool is_sending();
+
+    private:
+        SPI_TypeDef * const spi;
+        GPIOPin CS;
+        // TIM1 DMA request that feeds the SPI, and the channel that serves it
+        uint16_t timer_request;
+        DMA_Channel_TypeDef *dma_channel;
+        IRQn_Type dma_irq;
+
+        uint8_t buffer[MAX_SERIAL_BYTES];
+        volatile bool sending = false;
+        // Cycle count at which the controller is done with the last write
+        volatile uint32_t ready_time = 0;
+        // Whether the controller is in the extended instruction set, as of the last write
+        bool extended_set = false;
+
+        void init_hardware();
+        void wait_ready();
+        // Send one write without DMA; the next write waits for it to be done
+        void write(const BusWrite &write);
+    };
+
+    typedef BasicLCD12864<SerialLCDBus> SerialLCD12864;
+} // namespace lcd
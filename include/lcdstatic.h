@@ -0,0 +1,332 @@
+#pragma once
+
+#include <delay.h>
+#include "basiclcd12864.h"
+#include "gdramplan.h"
+#include "gpiopin.h"
+#include "lcdbase.h"
+#include "stm32f10x.h"
+#include "util.h"
+
+/*
+ * LCD bus with the pins fixed at compile time.
+ *
+ * This does the same bus operations as LCDBase, but the ports and pins are template parameters instead of
+ * GPIOPin members. The BSRR tables and configuration register masks are computed by the compiler, the bus
+ * operations are non-virtual and can be inlined, and there is no vtable. Only the 8-bit interface is supported.
+ */
+namespace lcd {
+
+    // A GPIO pin, given by the base address of its port and its pin mask (e.g. GPIOC_BASE, GPIO_Pin_10)
+    template <uint32_t PORT_BASE, uint16_t PIN>
+    struct StaticPin {
+        static constexpr uint32_t port_base = PORT_BASE;
+        static constexpr uint16_t pin = PIN;
+
+        static GPIO_TypeDef* port() {
+            return reinterpret_cast<GPIO_TypeDef*>(PORT_BASE);
+        }
+        static void set(bool value) {
+            if (value) {
+                port()->BSRR = PIN;
+            }
+            else {
+                port()->BRR = PIN;
+            }
+        }
+        static bool get() {
+            return port()->IDR & PIN;
+        }
+    };
+
+    namespace detail {
+
+        // Everything set_data_port and set_GPIO_mode need to know about the data pins, per port
+        struct StaticDataPorts {
+            uint8_t count;
+            uint32_t port_base[8];
+            uint16_t pins[8];
+            uint32_t crl_mask[8];
+            uint32_t crh_mask[8];
+            // Same as LCDBase::DataPortTable
+            uint32_t low[8][16];
+            uint32_t high[8][16];
+        };
+
+        constexpr uint32_t config_mask(uint8_t pins) {
+            uint32_t mask = 0;
+            for (uint8_t i = 0; i < 8; i ++) {
+                if (pins & 1 << i) {
+                    mask |= 0xFu << (i * 4);
+                }
+            }
+            return mask;
+        }
+
+        // Group the data pins (D0 first) by port and build their tables
+        constexpr StaticDataPorts make_data_ports(const uint32_t (&port_base)[8], const uint16_t (&pins)[8]) {
+            StaticDataPorts ports = {};
+            for (uint8_t bit = 0; bit < 8; bit ++) {
+                uint8_t i = 0;
+                while (i < ports.count && ports.port_base[i] != port_base[bit]) {
+                    i ++;
+                }
+                if (i == ports.count) {
+                    ports.port_base[ports.count ++] = port_base[bit];
+                }
+                ports.pins[i] |= pins[bit];
+                for (uint8_t value = 0; value < 16; value ++) {
+                    uint32_t word = value & (1 << bit % 4) ? pins[bit] : static_cast<uint32_t>(pins[bit]) << 16;
+                    if (bit < 4) {
+                        ports.low[i][value] |= word;
+                    }
+                    else {
+                        ports.high[i][value] |= word;
+                    }
+                }
+            }
+            for (uint8_t i = 0; i < ports.count; i ++) {
+                ports.crl_mask[i] = config_mask(ports.pins[i] & 0xFF);
+                ports.crh_mask[i] = config_mask(ports.pins[i] >> 8);
+            }
+            return ports;
+        }
+
+        // Configuration field of one pin in CRL/CRH, the same encoding as GPIO_Init
+        constexpr uint32_t config_field(GPIOMode_TypeDef mode, GPIOSpeed_TypeDef speed) {
+            return (mode & 0x0F) | (mode & 0x10 ? speed : 0);
+        }
+
+        // Switch pins to a mode with masked writes to CRL and CRH, like LCDBase::set_pins_mode
+        inline void set_pins_mode(GPIO_TypeDef *port, uint16_t pins, uint32_t crl_mask, uint32_t crh_mask,
+                GPIOMode_TypeDef mode, GPIOSpeed_TypeDef speed) {
+            const uint32_t field = config_field(mode, speed) * 0x11111111;
+            if (crl_mask) {
+                port->CRL = (port->CRL & ~crl_mask) | (field & crl_mask);
+            }
+            if (crh_mask) {
+                port->CRH = (port->CRH & ~crh_mask) | (field & crh_mask);
+            }
+            if (mode == GPIO_Mode_IPU) {
+                port->BSRR = pins;
+            }
+            else if (mode == GPIO_Mode_IPD) {
+                port->BRR = pins;
+            }
+        }
+
+        // Clock enable bit of a GPIO port in RCC_APB2ENR
+        constexpr uint32_t gpio_rcc_periph(uint32_t port_base) {
+            return RCC_APB2Periph_GPIOA << (port_base - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE);
+        }
+    } // namespace detail
+
+    // Pin assignment of an LCD on the 8-bit interface
+    template <typename RS_, typename RW_, typename E_, typename D0, typename D1, typename D2, typename D3,
+            typename D4, typename D5, typename D6, typename D7_>
+    struct StaticPinMap {
+        typedef RS_ RS;
+        typedef RW_ RW;
+        typedef E_ E;
+        typedef D7_ D7;
+
+        static constexpr uint32_t DATA_PORT_BASES[8] = {
+            D0::port_base, D1::port_base, D2::port_base, D3::port_base,
+            D4::port_base, D5::port_base, D6::port_base, D7::port_base,
+        };
+        static constexpr uint16_t DATA_PINS[8] = {
+            D0::pin, D1::pin, D2::pin, D3::pin, D4::pin, D5::pin, D6::pin, D7::pin,
+        };
+        static constexpr detail::StaticDataPorts DATA_PORTS = detail::make_data_ports(DATA_PORT_BASES, DATA_PINS);
+    };
+    template <typename RS, typename RW, typename E, typename D0, typename D1, typename D2, typename D3,
+            typename D4, typename D5, typename D6, typename D7>
+    constexpr uint32_t StaticPinMap<RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7>::DATA_PORT_BASES[8];
+    template <typename RS, typename RW, typename E, typename D0, typename D1, typename D2, typename D3,
+            typename D4, typename D5, typename D6, typename D7>
+    constexpr uint16_t StaticPinMap<RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7>::DATA_PINS[8];
+    template <typename RS, typename RW, typename E, typename D0, typename D1, typename D2, typename D3,
+            typename D4, typename D5, typename D6, typename D7>
+    constexpr detail::StaticDataPorts StaticPinMap<RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7>::DATA_PORTS;
+
+    template <typename Pins>
+    class StaticLCDBase {
+    public:
+        StaticLCDBase(uint32_t timeout = 1000000) : timeout(timeout) {
+            init_GPIO();
+        }
+
+        uint32_t get_timeout() {
+            return timeout;
+        }
+        void set_timeout(uint32_t t) {
+            timeout = t;
+        }
+
+        // See LCDBase::set_timed_mode()
+        bool is_timed_mode() {
+            return timed_mode;
+        }
+        void set_timed_mode(bool timed) {
+            if (timed && !timed_mode) {
+                delay::init_cycle_counter();
+                ready_time = delay::cycle_count();
+            }
+            timed_mode = timed;
+        }
+
+        void write_cmd(uint8_t cmd) {
+            wait_ready();
+            NoInterrupt noi;
+            send(cmd, false);
+        }
+        void write_data(uint8_t data) {
+            wait_ready();
+            NoInterrupt noi;
+            send(data, true);
+        }
+        uint8_t read_data() {
+            wait_ready();
+            NoInterrupt noi;
+            RS::set(true);
+            RW::set(true);
+            E::set(true);
+            edelay();
+            uint8_t out = read_data_port();
+            E::set(false);
+            set_busy_for(LCD_EXEC_TIME);
+            return out;
+        }
+
+    protected:
+        typedef typename Pins::RS RS;
+        typedef typename Pins::RW RW;
+        typedef typename Pins::E E;
+        typedef typename Pins::D7 D7;
+        static constexpr const detail::StaticDataPorts &PORTS = Pins::DATA_PORTS;
+
+        uint32_t timeout;
+        bool timed_mode = false;
+        uint32_t ready_time = 0;
+        bool extended_set = false;
+
+        static void edelay() {
+            delay::cycles(LCD_ENABLE_DELAY);
+        }
+
+        void wait_ready() {
+            if (!timed_mode) {
+                wait_busy();
+                return;
+            }
+            while (static_cast<int32_t>(ready_time - delay::cycle_count()) > 0);
+        }
+        void set_busy_for(uint16_t us) {
+            if (timed_mode) {
+                ready_time = delay::cycle_count() + us * SYSCLK_FREQUENCY;
+            }
+        }
+
+        void wait_busy() {
+            {
+                NoInterrupt noi;
+                D7::set(true);
+                RS::set(false);
+                RW::set(true);
+                E::set(true);
+                edelay();
+            }
+            set_D7_mode(GPIO_Mode_IPU, GPIO_Speed_50MHz);
+            while (D7::get()) {
+                NoInterrupt noi;
+                E::set(false);
+                edelay();
+                E::set(true);
+            }
+            E::set(false);
+            set_D7_mode(GPIO_Mode_Out_PP, GPIO_Speed_50MHz);
+        }
+
+        // Send writes from a plan; on this bus they are always sent right away
+        void send_writes(const BusWrite *writes, uint16_t count) {
+            for (uint16_t i = 0; i < count; i ++) {
+                NoInterrupt noi;
+                wait_ready();
+                send(writes[i].value, writes[i].data);
+            }
+        }
+        bool is_sending() {
+            return false;
+        }
+
+        // The same as LCDBase::write_cmd_no_wait()
+        void write_cmd_no_wait(uint8_t cmd) {
+            NoInterrupt noi;
+            send(cmd, false);
+        }
+
+        // Put a byte on the bus and strobe E, without waiting for the controller
+        void send(uint8_t value, bool data) {
+            RS::set(data);
+            RW::set(false);
+            set_data_port(value);
+            E::set(true);
+            edelay();
+            E::set(false);
+            extended_set = next_instruction_set(value, data, extended_set);
+            set_busy_for(exec_time(value, data, extended_set));
+        }
+
+        static void set_data_port(uint8_t data) {
+            // The loop bound is a constant, so this unrolls into one store per port
+            for (uint8_t i = 0; i < PORTS.count; i ++) {
+                port(i)->BSRR = PORTS.low[i][data & 0x0F] | PORTS.high[i][data >> 4];
+            }
+        }
+        static uint8_t read_data_port() {
+            set_GPIO_mode(GPIO_Mode_IPU, GPIO_Speed_50MHz);
+            uint8_t result = 0;
+            for (uint8_t bit = 0; bit < 8; bit ++) {
+                GPIO_TypeDef *port = reinterpret_cast<GPIO_TypeDef*>(Pins::DATA_PORT_BASES[bit]);
+                result |= (port->IDR & Pins::DATA_PINS[bit] ? 1 : 0) << bit;
+            }
+            set_GPIO_mode(GPIO_Mode_Out_PP, GPIO_Speed_50MHz);
+            return result;
+        }
+        static void set_GPIO_mode(GPIOMode_TypeDef mode, GPIOSpeed_TypeDef speed) {
+            for (uint8_t i = 0; i < PORTS.count; i ++) {
+                detail::set_pins_mode(port(i), PORTS.pins[i], PORTS.crl_mask[i], PORTS.crh_mask[i], mode, speed);
+            }
+        }
+
+    private:
+        static GPIO_TypeDef* port(uint8_t i) {
+            return reinterpret_cast<GPIO_TypeDef*>(PORTS.port_base[i]);
+        }
+        static void set_D7_mode(GPIOMode_TypeDef mode, GPIOSpeed_TypeDef speed) {
+            detail::set_pins_mode(D7::port(), D7::pin, detail::config_mask(D7::pin & 0xFF),
+                    detail::config_mask(D7::pin >> 8), mode, speed);
+        }
+
+        void init_GPIO() {
+            for (uint8_t i = 0; i < PORTS.count; i ++) {
+                RCC_APB2PeriphClockCmd(detail::gpio_rcc_periph(PORTS.port_base[i]), ENABLE);
+            }
+            GPIOPin(RS::port(), RS::pin).init(GPIO_Mode_Out_PP, GPIO_Speed_10MHz);
+            GPIOPin(RW::port(), RW::pin).init(GPIO_Mode_Out_PP, GPIO_Speed_10MHz);
+            GPIOPin(E::port(), E::pin).init(GPIO_Mode_Out_PP, GPIO_Speed_10MHz);
+
+            set_GPIO_mode(GPIO_Mode_Out_PP, GPIO_Speed_50MHz);
+
+            set_data_port(0x00);
+            RS::set(false);
+            RW::set(false);
+            E::set(false);
+        }
+    };
+
+    // LCD12864 with the pins fixed at compile time
+    // Updates are blocking, since there is no DMA engine or write queue
+    template <typename Pins>
+    using StaticLCD12864 = BasicLCD12864<StaticLCDBase<Pins>>;
+} // namespace lcd
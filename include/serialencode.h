@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "gdramplan.h"
+
+namespace lcd {
+
+    /*
+     * Encoding of bus writes for the ST7920's serial mode.
+     *
+     * Every write is sent as three bytes, MSB first: a sync byte of five 1s followed by RW, RS and a 0, then the
+     * high nibble of the value and then the low nibble, each in the upper half of its byte.
+     */
+
+    constexpr uint8_t SERIAL_BYTES_PER_WRITE = 3;
+    // Bytes needed for the largest GDRAM update
+    constexpr uint16_t MAX_SERIAL_BYTES = MAX_GDRAM_WRITES * SERIAL_BYTES_PER_WRITE;
+
+    // Sync byte of a command write; RS (bit 1) is set for data writes, and RW (bit 2) is always clear
+    constexpr uint8_t SERIAL_SYNC = 0xF8;
+    constexpr uint8_t SERIAL_RS = 0x02;
+
+    inline void encode_serial_write(const BusWrite &write, uint8_t *out) {
+        out[0] = write.data ? SERIAL_SYNC | SERIAL_RS : SERIAL_SYNC;
+        out[1] = write.value & 0xF0;
+        out[2] = write.value << 4;
+    }
+
+    // Encode count writes into out, which must have room for count * SERIAL_BYTES_PER_WRITE bytes
+    // Returns the number of bytes
+    // This doesn't touch the hardware, so it can be run and checked on the host
+    uint16_t encode_serial(const BusWrite *writes, uint16_t count, uint8_t *out);
+} // namespace lcd
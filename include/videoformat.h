@@ -0,0 +1,362 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Container header at the start of every video, shared by the encoder, the viewer and the firmware decoder.
+ *
+ * The header is HEADER_SIZE bytes, or header_size() with a run length code, so the bitstream after it starts word
+ * aligned. Multi-byte fields are big endian, like the rest of the bitstream:
+ *
+ *     0  magic "TCBA"
+ *     4  format version
+ *     5  feature flags (see Flags)
+ *     6  frame width, frame height
+ *     8  framerate (frames per second)
+ *     9  chunk grid columns, rows
+ *    11  RLE group size (bits per group of a repeat count)
+ *    12  frame count (0 if unknown)
+ *    16  keyframe interval (0 if only the first frame is one)         version 2 and up
+ *    18  reserved
+ *    20  byte offset of the keyframe index (0 if there isn't one)     version 2 and up
+ *    24  run length code (see below), RUN_CODE_SIZE bytes             version 3 and up, only with HUFFMAN_RUNS
+ *    24  rANS tables (see below), RANS_TABLE_SIZE bytes               version 3 and up, only with RANS_CODED
+ *
+ * Every frame whose number is a multiple of the keyframe interval is a keyframe: it starts on a byte boundary
+ * and is coded on its own, like the first frame, so decoding can start from it. The keyframe index lists the
+ * byte offset of every keyframe from the start of the video, 4 bytes each, in order. The first entry is the
+ * first frame.
+ *
+ * By default, run lengths are written as a group count in unary and then that many groups of bits (see
+ * repeat_offsets()). With HUFFMAN_RUNS, they use a canonical Huffman code made for the video instead. Every run
+ * length maps to a symbol (see run_symbol()), and the header has the length of each symbol's code, 4 bits each,
+ * high nibble first; symbols that aren't used have a length of 0. Codes are handed out in order of length, and
+ * then symbol, like in DEFLATE.
+ *
+ * With RANS_CODED, everything after the header except the keyframe index is one rANS stream per keyframe
+ * interval instead. Each starts on a byte boundary with the 32-bit coder state, and then has the bytes the
+ * coder reads as it goes; decoding the last frame before the next keyframe ends right where the next stream
+ * starts. Frames have the same fields as usual, in the same order, each coded with a static model:
+ *
+ *   - Chunk mask bits go from chunk 0 up. Each one has a binary model picked by mask_bit_model(), from the bit
+ *     before it and the same chunk's bit in the frame before (all set after a keyframe).
+ *   - The scroll flag has a binary model of its own; the scroll itself is 7 raw bits.
+ *   - The first pixel value of a frame is a raw bit.
+ *   - Run lengths use the symbols of the Huffman code, then the extra bits as raw bits.
+ *
+ * The models are in the header: the frequency of each run symbol, which add up to RANS_SCALE, and then the
+ * frequency of a 0 for each binary model, out of RANS_SCALE, all 16 bits. A raw n-bit value v is coded as
+ * the range of v << (RANS_SCALE_BITS - n) with frequency 1 << (RANS_SCALE_BITS - n). The coder is the usual
+ * byte-wise one: the state stays in [RANS_LOWER_BOUND, RANS_LOWER_BOUND << 8), and is topped up a byte at a time.
+ *
+ * Version 1 headers are V1_HEADER_SIZE bytes and stop after the frame count. Videos that don't start with the
+ * magic use the original header, which is just the width and height, with every other field set to its default.
+ * The Python prototype still writes those.
+ */
+namespace video {
+
+    constexpr uint8_t MAGIC[4] = { 'T', 'C', 'B', 'A' };
+    constexpr uint8_t VERSION = 3;
+    // Size of the fixed part of the header
+    constexpr uint8_t HEADER_SIZE = 24;
+    constexpr uint8_t V1_HEADER_SIZE = 16;
+    constexpr uint8_t LEGACY_HEADER_SIZE = 2;
+    // Size of an entry in the keyframe index
+    constexpr uint8_t INDEX_ENTRY_SIZE = 4;
+
+    enum Flags : uint8_t {
+        // Every frame after the first has a scroll op after its chunk mask
+        SCROLL_OPS = 0x01,
+        // Run lengths use the Huffman code in the header
+        HUFFMAN_RUNS = 0x02,
+        // Everything is coded with rANS, using the tables in the header
+        RANS_CODED = 0x04,
+        KNOWN_FLAGS = SCROLL_OPS | HUFFMAN_RUNS | RANS_CODED,
+    };
+
+    // Largest chunk grid: the chunk mask is one 64-bit word, and a column of chunks has to fit in a byte
+    constexpr uint8_t MAX_CHUNK_COUNT_X = 8;
+    constexpr uint8_t MAX_CHUNK_COUNT_Y = 8;
+    // Largest RLE group size; the value bits of any repeat in a frame have to fit in 32 bits
+    constexpr uint8_t MAX_GROUP_SIZE = 8;
+
+    // Runs of up to this many pixels have a symbol each; longer ones share a symbol per power of two
+    constexpr uint8_t RUN_LITERALS = 64;
+    // Enough symbols for every run up to MAX_REPEAT (see run_symbol())
+    constexpr uint8_t RUN_SYMBOLS = RUN_LITERALS + 7;
+    // Longest code a run symbol can have; decoders look codes up in a table this many bits wide
+    constexpr uint8_t MAX_RUN_CODE_LENGTH = 10;
+    constexpr uint8_t RUN_CODE_SIZE = (RUN_SYMBOLS + 1) / 2;
+
+    // Probabilities in the rANS models are out of RANS_SCALE; the decoder has a table with an entry for each
+    constexpr uint8_t RANS_SCALE_BITS = 12;
+    constexpr uint16_t RANS_SCALE = 1 << RANS_SCALE_BITS;
+    constexpr uint32_t RANS_LOWER_BOUND = 1ul << 23;
+    // Four models for the chunk mask bits (see mask_bit_model()), then the scroll flag's
+    constexpr uint8_t RANS_BIT_MODELS = 5;
+    constexpr uint8_t RANS_SCROLL_MODEL = 4;
+    constexpr uint8_t RANS_TABLE_SIZE = (RUN_SYMBOLS + RANS_BIT_MODELS) * 2;
+
+    constexpr uint8_t MAX_HEADER_SIZE = HEADER_SIZE + RANS_TABLE_SIZE;
+
+    struct Header {
+        // 0 for the original two byte header
+        uint8_t version;
+        uint8_t flags;
+        uint8_t width;
+        uint8_t height;
+        uint8_t framerate;
+        uint8_t chunk_count_x;
+        uint8_t chunk_count_y;
+        uint8_t group_size;
+        uint32_t frame_count;
+        uint16_t keyframe_interval;
+        uint32_t index_offset;
+        // Code length of every run symbol, with HUFFMAN_RUNS
+        uint8_t run_code_lengths[RUN_SYMBOLS];
+        // Frequency of every run symbol, and of a 0 for every binary model, with RANS_CODED
+        uint16_t rans_run_freqs[RUN_SYMBOLS];
+        uint16_t rans_bit_freqs[RANS_BIT_MODELS];
+    };
+
+    // What the codec used before the header had these fields
+    constexpr Header DEFAULT_HEADER = { VERSION, 0, 128, 64, 12, 8, 8, 3, 0, 0, 0, {}, {}, {} };
+
+    // Size of the header, including the run length code or rANS tables if it has them
+    constexpr uint8_t header_size(const Header &header) {
+        return header.flags & HUFFMAN_RUNS ? HEADER_SIZE + RUN_CODE_SIZE
+            : header.flags & RANS_CODED ? HEADER_SIZE + RANS_TABLE_SIZE : HEADER_SIZE;
+    }
+
+    // Whether the run length code is one a decoder can use: no longer than MAX_RUN_CODE_LENGTH, at least one
+    // symbol, and no more codes than there is room for (Kraft's inequality)
+    constexpr bool is_valid_run_code(const Header &header) {
+        uint32_t used = 0;
+        for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+            const uint8_t length = header.run_code_lengths[symbol];
+            if (length > MAX_RUN_CODE_LENGTH) {
+                return false;
+            }
+            if (length) {
+                used += 1ul << (MAX_RUN_CODE_LENGTH - length);
+            }
+        }
+        return used && used <= 1ul << MAX_RUN_CODE_LENGTH;
+    }
+
+    // Whether the rANS tables are ones a decoder can use: the run symbol frequencies add up to RANS_SCALE, and
+    // both values of every binary model are possible
+    constexpr bool is_valid_rans_tables(const Header &header) {
+        uint32_t total = 0;
+        for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+            total += header.rans_run_freqs[symbol];
+        }
+        for (uint8_t model = 0; model < RANS_BIT_MODELS; model ++) {
+            if (!header.rans_bit_freqs[model] || header.rans_bit_freqs[model] >= RANS_SCALE) {
+                return false;
+            }
+        }
+        return total == RANS_SCALE;
+    }
+
+    // Binary model of a chunk mask bit with RANS_CODED, from the bit before it in the mask (0 for the first) and
+    // the same bit in the last frame's mask
+    constexpr uint8_t mask_bit_model(bool before, bool last) {
+        return before | last << 1;
+    }
+
+    // Whether frame number frame is a keyframe
+    constexpr bool is_keyframe(const Header &header, uint32_t frame) {
+        return frame == 0 || (header.keyframe_interval && frame % header.keyframe_interval == 0);
+    }
+
+    // Number of entries in the keyframe index
+    constexpr uint32_t keyframe_count(const Header &header) {
+        return !header.frame_count ? 0
+            : header.keyframe_interval ? (header.frame_count - 1) / header.keyframe_interval + 1 : 1;
+    }
+
+    // Whether a decoder for this version of the format can play the video
+    constexpr bool is_supported(const Header &header) {
+        return header.version <= VERSION && !(header.flags & ~KNOWN_FLAGS)
+            && (!(header.flags & HUFFMAN_RUNS) || is_valid_run_code(header))
+            // An rANS stream has no end of its own, so the frame count is needed to know where to stop
+            && (!(header.flags & RANS_CODED)
+                || (!(header.flags & HUFFMAN_RUNS) && header.frame_count && is_valid_rans_tables(header)))
+            && header.width >= 1 && header.width <= 128 && header.height >= 1 && header.height <= 64
+            && header.framerate >= 1
+            && header.chunk_count_x >= 1 && header.chunk_count_x <= MAX_CHUNK_COUNT_X
+            && header.chunk_count_y >= 1 && header.chunk_count_y <= MAX_CHUNK_COUNT_Y
+            && header.group_size >= 1 && header.group_size <= MAX_GROUP_SIZE;
+    }
+
+    // Big endian integer of size bytes
+    inline uint32_t read_be(const uint8_t *data, uint8_t size) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < size; i ++) {
+            value = value << 8 | data[i];
+        }
+        return value;
+    }
+    inline void write_be(uint8_t *out, uint32_t value, uint8_t size) {
+        for (uint8_t i = size; i --;) {
+            out[i] = value;
+            value >>= 8;
+        }
+    }
+
+    // Read the header from the start of a video, which is size bytes long
+    // Returns the size of the header, or 0 if there isn't enough data for one (header is still filled in)
+    inline uint8_t read_header(const uint8_t *data, uint32_t size, Header &header) {
+        for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+            header.run_code_lengths[symbol] = 0;
+            header.rans_run_freqs[symbol] = 0;
+        }
+        for (uint8_t model = 0; model < RANS_BIT_MODELS; model ++) {
+            header.rans_bit_freqs[model] = 0;
+        }
+        if (size >= V1_HEADER_SIZE && data[0] == MAGIC[0] && data[1] == MAGIC[1] && data[2] == MAGIC[2]
+                && data[3] == MAGIC[3]) {
+            header.version = data[4];
+            header.flags = data[5];
+            header.width = data[6];
+            header.height = data[7];
+            header.framerate = data[8];
+            header.chunk_count_x = data[9];
+            header.chunk_count_y = data[10];
+            header.group_size = data[11];
+            header.frame_count = read_be(data + 12, 4);
+            header.keyframe_interval = 0;
+            header.index_offset = 0;
+            if (header.version < 2) {
+                return V1_HEADER_SIZE;
+            }
+            if (size < HEADER_SIZE) {
+                return 0;
+            }
+            header.keyframe_interval = read_be(data + 16, 2);
+            header.index_offset = read_be(data + 20, 4);
+            if (header.version < 3) {
+                return HEADER_SIZE;
+            }
+            if (size < header_size(header)) {
+                return 0;
+            }
+            if (header.flags & HUFFMAN_RUNS) {
+                for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+                    const uint8_t byte = data[HEADER_SIZE + symbol / 2];
+                    header.run_code_lengths[symbol] = symbol % 2 ? byte & 0x0F : byte >> 4;
+                }
+            }
+            else if (header.flags & RANS_CODED) {
+                for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+                    header.rans_run_freqs[symbol] = read_be(data + HEADER_SIZE + symbol * 2, 2);
+                }
+                for (uint8_t model = 0; model < RANS_BIT_MODELS; model ++) {
+                    header.rans_bit_freqs[model] = read_be(data + HEADER_SIZE + (RUN_SYMBOLS + model) * 2, 2);
+                }
+            }
+            return header_size(header);
+        }
+        header = DEFAULT_HEADER;
+        header.version = 0;
+        if (size < LEGACY_HEADER_SIZE) {
+            return 0;
+        }
+        header.width = data[0];
+        header.height = data[1];
+        return LEGACY_HEADER_SIZE;
+    }
+
+    // Write the header in the current version of the format into out, which must have room for header_size() bytes
+    inline void write_header(const Header &header, uint8_t *out) {
+        for (uint8_t i = 0; i < 4; i ++) {
+            out[i] = MAGIC[i];
+        }
+        out[4] = header.version;
+        out[5] = header.flags;
+        out[6] = header.width;
+        out[7] = header.height;
+        out[8] = header.framerate;
+        out[9] = header.chunk_count_x;
+        out[10] = header.chunk_count_y;
+        out[11] = header.group_size;
+        write_be(out + 12, header.frame_count, 4);
+        write_be(out + 16, header.keyframe_interval, 2);
+        write_be(out + 18, 0, 2);
+        write_be(out + 20, header.index_offset, 4);
+        if (header.flags & HUFFMAN_RUNS) {
+            for (uint8_t i = 0; i < RUN_CODE_SIZE; i ++) {
+                out[HEADER_SIZE + i] = 0;
+            }
+            for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+                out[HEADER_SIZE + symbol / 2] |= (header.run_code_lengths[symbol] & 0x0F) << (symbol % 2 ? 0 : 4);
+            }
+        }
+        else if (header.flags & RANS_CODED) {
+            for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+                write_be(out + HEADER_SIZE + symbol * 2, header.rans_run_freqs[symbol], 2);
+            }
+            for (uint8_t model = 0; model < RANS_BIT_MODELS; model ++) {
+                write_be(out + HEADER_SIZE + (RUN_SYMBOLS + model) * 2, header.rans_bit_freqs[model], 2);
+            }
+        }
+    }
+
+    // Longest run a frame can have
+    constexpr uint16_t MAX_REPEAT = 128 * 64;
+    // Most groups a repeat count up to MAX_REPEAT can take, with a group size of 1
+    constexpr uint8_t MAX_GROUPS = 13;
+    typedef uint32_t RepeatOffsets[MAX_GROUPS + 1];
+
+    // Fill offsets for a group size: offsets[g] is the first repeat count (minus 1) that takes g + 1 groups
+    // With a group size of 3, this is 0, 8, 72, 584, 4680, 37448
+    // Once a count past MAX_REPEAT is reached, the rest are the same
+    inline void repeat_offsets(uint8_t group_size, RepeatOffsets &offsets) {
+        offsets[0] = 0;
+        for (uint8_t groups = 1; groups <= MAX_GROUPS; groups ++) {
+            const uint32_t last = offsets[groups - 1];
+            offsets[groups] = last > MAX_REPEAT ? last : last + (1ul << (group_size * groups));
+        }
+    }
+
+    // Symbol of a run length for the Huffman code (1 <= run <= MAX_REPEAT)
+    // Runs up to RUN_LITERALS are their own symbol. A longer run, minus 1, is split into its highest set bit, which
+    // picks the symbol, and the bits below it, which are written after the code (see run_extra_bits())
+    inline uint8_t run_symbol(uint16_t run) {
+        const uint16_t value = run - 1;
+        if (value < RUN_LITERALS) {
+            return value;
+        }
+        // RUN_LITERALS is 1 << 6, so the first of these has its highest bit at 6
+        return RUN_LITERALS + (31 - __builtin_clz(value)) - 6;
+    }
+
+    // Number of bits after a symbol's code
+    constexpr uint8_t run_extra_bits(uint8_t symbol) {
+        return symbol < RUN_LITERALS ? 0 : symbol - RUN_LITERALS + 6;
+    }
+
+    // Shortest run with a symbol; the extra bits are added to it
+    constexpr uint16_t run_base(uint8_t symbol) {
+        return symbol < RUN_LITERALS ? symbol + 1 : (1u << run_extra_bits(symbol)) + 1;
+    }
+
+    // Canonical codes from the code lengths in a header
+    // Each code is in the lowest run_code_lengths[symbol] bits of codes[symbol], and is written most significant bit
+    // first; symbols without a code get 0
+    inline void run_codes(const Header &header, uint16_t (&codes)[RUN_SYMBOLS]) {
+        for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+            codes[symbol] = 0;
+        }
+        uint16_t code = 0;
+        for (uint8_t length = 1; length <= MAX_RUN_CODE_LENGTH; length ++) {
+            for (uint8_t symbol = 0; symbol < RUN_SYMBOLS; symbol ++) {
+                if (header.run_code_lengths[symbol] == length) {
+                    codes[symbol] = code ++;
+                }
+            }
+            code <<= 1;
+        }
+    }
+} // namespace video
@@ -1,142 +1,415 @@
 #include "decoder.h"
 
 #include <algorithm>
+#include <string.h>
 
-constexpr uint8_t CHUNK_COUNT_X = 8;
-constexpr uint8_t CHUNK_COUNT_Y = 8;
-constexpr uint8_t CHUNK_COUNT = CHUNK_COUNT_Y * CHUNK_COUNT_X;
+// Size of the chunks along one side of the frame, rounded up; the right & bottom chunks are a little smaller
+// An unsupported header can have no chunks at all, so don't divide by zero for it
+static uint8_t chunk_size(uint8_t frame_size, uint8_t chunk_count) {
+    return chunk_count ? (frame_size - 1) / chunk_count + 1 : 0;
+}
 
-VideoDecoder::VideoDecoder() : FRAME_WIDTH(read_bits(8)), FRAME_HEIGHT(read_bits(8)),
+VideoDecoder::VideoDecoder(const uint8_t *data, uint32_t size) : data(data), data_size(size),
+    HEADER_SIZE(video::read_header(data, size, format)),
+    FRAME_WIDTH(format.width), FRAME_HEIGHT(format.height), SCROLL_OPS(format.flags & video::SCROLL_OPS),
+    HUFFMAN_RUNS(format.flags & video::HUFFMAN_RUNS), RANS_CODED(format.flags & video::RANS_CODED),
     FRAME_OFFSET_X((128 - FRAME_WIDTH) / 2), FRAME_OFFSET_Y((64 - FRAME_HEIGHT) / 2),
-    CHUNK_WIDTH((FRAME_WIDTH - 1) / CHUNK_COUNT_X + 1), CHUNK_HEIGHT((FRAME_HEIGHT - 1) / CHUNK_COUNT_Y + 1) {}
+    CHUNK_COUNT_X(format.chunk_count_x), CHUNK_COUNT_Y(format.chunk_count_y),
+    CHUNK_COUNT(CHUNK_COUNT_X * CHUNK_COUNT_Y),
+    CHUNK_WIDTH(chunk_size(FRAME_WIDTH, CHUNK_COUNT_X)), CHUNK_HEIGHT(chunk_size(FRAME_HEIGHT, CHUNK_COUNT_Y)),
+    GROUP_SIZE(format.group_size) {
+    if (!is_supported()) {
+        return;
+    }
+    video::repeat_offsets(GROUP_SIZE, repeat_offsets);
+    if (HUFFMAN_RUNS) {
+        build_run_table();
+    }
+    if (RANS_CODED) {
+        build_rans_tables();
+    }
+    // Skip the header; the bitstream starts right after it
+    for (uint8_t i = 0; i < HEADER_SIZE; i ++) {
+        read_bits(8);
+    }
+}
+
+void VideoDecoder::build_run_table() {
+    uint16_t codes[video::RUN_SYMBOLS];
+    video::run_codes(format, codes);
+    // Codes that are too short for the table fill every entry that starts with them
+    // is_valid_run_code() makes sure they don't overlap; entries no code starts with are left at 0 (an empty code)
+    memset(run_table, 0, sizeof(run_table));
+    for (uint8_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+        const uint8_t length = format.run_code_lengths[symbol];
+        if (!length) {
+            continue;
+        }
+        const uint8_t spare = video::MAX_RUN_CODE_LENGTH - length;
+        const uint16_t first = codes[symbol] << spare;
+        for (uint16_t i = 0; i < 1u << spare; i ++) {
+            run_table[first + i] = symbol << 4 | length;
+        }
+    }
+}
+
+void VideoDecoder::build_rans_tables() {
+    // Symbols get their slots in order; is_valid_rans_tables() makes sure they add up to exactly all of them
+    uint16_t start = 0;
+    for (uint8_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+        rans_run_starts[symbol] = start;
+        memset(rans_symbols + start, symbol, format.rans_run_freqs[symbol]);
+        start += format.rans_run_freqs[symbol];
+    }
+}
+
+bool VideoDecoder::is_supported() const {
+    return HEADER_SIZE && video::is_supported(format);
+}
+
+void VideoDecoder::refill() {
+    // Aligned word load; memcpy keeps this legal C++ and compiles to a single LDR
+    uint32_t word;
+    memcpy(&word, data + word_idx * 4, 4);
+    // The video data is big endian, so the first bit ends up as the MSB (compiles to REV)
+    cache = __builtin_bswap32(word);
+    cache_bits = 32;
+    word_idx ++;
+}
+
+uint32_t VideoDecoder::bits_left() const {
+    uint32_t consumed = word_idx * 32 - cache_bits;
+    return consumed < data_size * 8 ? data_size * 8 - consumed : 0;
+}
+
+// Drop count bits from the front of the cache (count <= cache_bits)
+inline void VideoDecoder::consume(uint8_t count) {
+    cache = count < 32 ? cache << count : 0;
+    cache_bits -= count;
+}
+
+void VideoDecoder::align() {
+    consume(cache_bits % 8);
+}
+
+void VideoDecoder::move_to(uint32_t offset) {
+    word_idx = offset / 4;
+    cache = 0;
+    cache_bits = 0;
+    if (offset % 4) {
+        refill();
+        consume(offset % 4 * 8);
+    }
+}
+
+bool VideoDecoder::can_seek() const {
+    return is_supported() && format.index_offset && format.frame_count
+        && format.index_offset + video::keyframe_count(format) * video::INDEX_ENTRY_SIZE <= data_size;
+}
+
+bool VideoDecoder::seek(uint32_t frame) {
+    if (!can_seek()) {
+        return false;
+    }
+    if (frame >= format.frame_count) {
+        frame = format.frame_count - 1;
+    }
+    const uint32_t keyframe = format.keyframe_interval ? frame / format.keyframe_interval : 0;
+    move_to(video::read_be(data + format.index_offset + keyframe * video::INDEX_ENTRY_SIZE, 4));
+    frame_idx = keyframe * format.keyframe_interval;
+    return true;
+}
 
 bool VideoDecoder::read_bit() {
-    bool bit = viddata[byte_idx] & (1 << --bit_idx);
-    if (bit_idx == 0) {
-        bit_idx = 8;
-        byte_idx ++;
+    if (cache_bits == 0) {
+        refill();
     }
+    bool bit = cache >> 31;
+    consume(1);
     return bit;
 }
 
-uint64_t VideoDecoder::read_bits(uint8_t count) {
-    uint64_t out = 0;
-    for (uint8_t i = 0; i < count; i ++) {
-        out = out << 1 | read_bit();
+uint32_t VideoDecoder::read_bits(uint8_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    // Bits past the ones available are 0, so if the cache runs out this is the top part of the result
+    uint32_t out = cache >> (32 - count);
+    if (count <= cache_bits) {
+        consume(count);
+        return out;
+    }
+    // Get the rest from the next word
+    uint8_t rest = count - cache_bits;
+    refill();
+    out |= cache >> (32 - rest);
+    consume(rest);
+    return out;
+}
+
+uint32_t VideoDecoder::peek_bits(uint8_t count) const {
+    uint32_t out = cache >> (32 - count);
+    // Get the rest from the next word, if there is one
+    if (count > cache_bits && word_idx * 4 < data_size) {
+        uint32_t word;
+        memcpy(&word, data + word_idx * 4, 4);
+        out |= __builtin_bswap32(word) >> (32 - count + cache_bits);
     }
     return out;
 }
 
 uint16_t VideoDecoder::read_repeat_count() {
-    static const uint16_t OFFSETS[] = {
-		0, 8, 72, 584, 4680, 37448
-	};
-	static const uint8_t GROUP_SIZE = 3;
+    return RANS_CODED ? read_rans_repeat_count()
+        : HUFFMAN_RUNS ? read_huffman_repeat_count() : read_grouped_repeat_count();
+}
+
+void VideoDecoder::rans_start() {
+    rans_state = read_bits(32);
+    // Only a broken video can start below the bound, but a state of 0 would never be topped up
+    if (rans_state < video::RANS_LOWER_BOUND) {
+        rans_state = video::RANS_LOWER_BOUND;
+    }
+    // Keyframes have every chunk
+    rans_last_mask = ~0ull;
+}
+
+inline void VideoDecoder::rans_advance(uint16_t start, uint16_t freq) {
+    rans_state = freq * (rans_state >> video::RANS_SCALE_BITS) + (rans_state & (video::RANS_SCALE - 1)) - start;
+    while (rans_state < video::RANS_LOWER_BOUND) {
+        rans_state = rans_state << 8 | read_bits(8);
+    }
+}
+
+bool VideoDecoder::rans_bit(uint8_t model) {
+    const uint16_t zero = format.rans_bit_freqs[model];
+    const bool bit = (rans_state & (video::RANS_SCALE - 1)) >= zero;
+    rans_advance(bit ? zero : 0, bit ? video::RANS_SCALE - zero : zero);
+    return bit;
+}
+
+uint16_t VideoDecoder::rans_raw(uint8_t count) {
+    // Every value has the same number of slots
+    const uint8_t shift = video::RANS_SCALE_BITS - count;
+    const uint16_t value = (rans_state & (video::RANS_SCALE - 1)) >> shift;
+    rans_advance(value << shift, 1 << shift);
+    return value;
+}
+
+uint16_t VideoDecoder::read_rans_repeat_count() {
+    // The low bits of the state pick the symbol with one lookup
+    const uint8_t symbol = rans_symbols[rans_state & (video::RANS_SCALE - 1)];
+    rans_advance(rans_run_starts[symbol], format.rans_run_freqs[symbol]);
+    return video::run_base(symbol) + rans_raw(video::run_extra_bits(symbol));
+}
+
+uint16_t VideoDecoder::read_huffman_repeat_count() {
+    // One lookup finds the symbol and how long its code is, whatever the length
+    const uint16_t entry = run_table[peek_bits(video::MAX_RUN_CODE_LENGTH)];
+    read_bits(entry & 0x0F);
+    const uint8_t symbol = entry >> 4;
+    // Long runs have the low bits of the run after the code
+    return video::run_base(symbol) + read_bits(video::run_extra_bits(symbol));
+}
+
+uint16_t VideoDecoder::read_grouped_repeat_count() {
     // Find number of groups first
+    // The group count is in unary, so count the leading ones with CLZ
     uint8_t groups = 1;
-    while (read_bit()) {
-        groups ++;
+    while (true) {
+        // Bits past the ones available are 0, so this never counts past the end of the cache
+        uint8_t ones = ~cache ? __builtin_clz(~cache) : 32;
+        if (ones < cache_bits) {
+            groups += ones;
+            // Also drop the terminating 0
+            consume(ones + 1);
+            break;
+        }
+        // All ones until the end of the cache; keep counting in the next word
+        groups += cache_bits;
+        refill();
     }
-    // Read the right number of bits
-    uint16_t repeat;
-    read_bits(groups * GROUP_SIZE, repeat);
-    // Add the correct offsets
-    return repeat + OFFSETS[groups - 1] + 1;
+    // Read the right number of bits and add the correct offsets
+    return read_bits(groups * GROUP_SIZE) + repeat_offsets[groups - 1] + 1;
 }
 
-bool VideoDecoder::read_frame(uint8_t frame[64][16]) {
-    // Read the entire thing for the first frame
-    if (first_frame) {
-        first_frame = false;
+bool VideoDecoder::read_frame(framebuf::Frame frame) {
+    if (!is_supported() || (format.frame_count && frame_idx >= format.frame_count)) {
+        return false;
+    }
+    // Read the entire thing for the first frame and other keyframes
+    if (video::is_keyframe(format, frame_idx)) {
+        align();
+        if (RANS_CODED) {
+            rans_start();
+        }
+        frame_idx ++;
         return read_frame(frame, ~0ull);
     }
+    else if (RANS_CODED) {
+        // Same frame header, with every bit going through a model
+        uint64_t header = 0;
+        for (uint8_t chunk = 0; chunk < CHUNK_COUNT; chunk ++) {
+            const bool before = chunk && (header >> (chunk - 1) & 1);
+            if (rans_bit(video::mask_bit_model(before, rans_last_mask >> chunk & 1))) {
+                header |= 1ull << chunk;
+            }
+        }
+        rans_last_mask = header;
+        int8_t lines = 0;
+        if (SCROLL_OPS && rans_bit(video::RANS_SCROLL_MODEL)) {
+            lines = static_cast<int8_t>(rans_raw(7) << 1) >> 1;
+        }
+        frame_idx ++;
+        return read_frame(frame, header, lines);
+    }
     else {
         // Read the frame header
         uint64_t header;
         if (!read_bits(CHUNK_COUNT, header)) {
             return false;
         }
-        return read_frame(frame, header);
+        int8_t lines = 0;
+        if (SCROLL_OPS && read_bit()) {
+            // 7-bit two's complement; shift it up to sign extend
+            lines = static_cast<int8_t>(read_bits(7) << 1) >> 1;
+        }
+        frame_idx ++;
+        return read_frame(frame, header, lines);
     }
 }
 
-void set_pixel(uint8_t frame[64][16], uint8_t x, uint8_t y, bool val) {
-    uint8_t lcd_row = y;
-    uint8_t lcd_col = x / 8;
-    uint8_t lcd_col_offset = 7 - x % 8;
+// Set or clear count pixels going down a column of the frame buffer, starting at screen row y
+// byte_x is the byte of the row the column is in, and mask selects the pixel's bit within that byte
+static void fill_run(framebuf::Frame frame, uint8_t byte_x, uint8_t mask, uint8_t y, uint8_t count, bool val) {
+#ifdef FRAMEBUF_GDRAM_LAYOUT
+    // Rows are only evenly spaced within a half of the screen, so split runs that cross the middle
+    if (y < 32 && y + count > 32) {
+        fill_run(frame, byte_x, mask, y, 32 - y, val);
+        count -= 32 - y;
+        y = 32;
+    }
+#endif
+    uint8_t *p = &frame[0][0] + framebuf::row_offset(y) + byte_x;
     if (val) {
-        frame[lcd_row][lcd_col] |= 1 << lcd_col_offset;
+        for (; count; count --, p += framebuf::ROW_STRIDE) {
+            *p |= mask;
+        }
+    }
+    else {
+        const uint8_t clear_mask = ~mask;
+        for (; count; count --, p += framebuf::ROW_STRIDE) {
+            *p &= clear_mask;
+        }
+    }
+}
+
+void VideoDecoder::scroll_frame(framebuf::Frame frame, int8_t lines) {
+    uint8_t *base = &frame[0][0] + framebuf::row_offset(0);
+    // Copy whole rows in an order that never overwrites one before it's moved
+    // The borders are the same on every row, so they can move with the picture
+    if (lines > 0) {
+        for (uint8_t y = FRAME_OFFSET_Y; y + lines < FRAME_OFFSET_Y + FRAME_HEIGHT; y ++) {
+            memcpy(base + framebuf::row_offset(y), base + framebuf::row_offset(y + lines), 16);
+        }
     }
     else {
-        frame[lcd_row][lcd_col] &= ~(1 << lcd_col_offset);
+        for (uint8_t y = FRAME_OFFSET_Y + FRAME_HEIGHT; y -- > FRAME_OFFSET_Y - lines;) {
+            memcpy(base + framebuf::row_offset(y), base + framebuf::row_offset(y + lines), 16);
+        }
     }
+    framebuf::mark_dirty(dirty, FRAME_OFFSET_Y, FRAME_OFFSET_Y + FRAME_HEIGHT, 0xFF);
 }
 
-bool VideoDecoder::read_frame(uint8_t frame[64][16], uint64_t header) {
+bool VideoDecoder::read_frame(framebuf::Frame frame, uint64_t header, int8_t lines) {
+    memset(dirty, 0, sizeof(dirty));
+    scroll = lines;
+    if (lines) {
+        scroll_frame(frame, lines);
+    }
     // Return if no chunks changed
     if (!header) {
         return true;
     }
+    // Mark the words overlapping changed chunks, one row of chunks at a time
+    for (uint8_t cy = 0; cy < CHUNK_COUNT_Y && cy * CHUNK_HEIGHT < FRAME_HEIGHT; cy ++) {
+        uint8_t span = 0;
+        for (uint8_t cx = 0; cx < CHUNK_COUNT_X; cx ++) {
+            if (header & 1ull << (cx * CHUNK_COUNT_Y + cy)) {
+                span |= framebuf::word_span(FRAME_OFFSET_X + cx * CHUNK_WIDTH,
+                        FRAME_OFFSET_X + std::min<uint8_t>((cx + 1) * CHUNK_WIDTH, FRAME_WIDTH));
+            }
+        }
+        framebuf::mark_dirty(dirty, FRAME_OFFSET_Y + cy * CHUNK_HEIGHT,
+                FRAME_OFFSET_Y + std::min<uint8_t>((cy + 1) * CHUNK_HEIGHT, FRAME_HEIGHT), span);
+    }
     // Read starting bit value and first repeat count
-    bool current = read_bit();
+    bool current = RANS_CODED ? rans_raw(1) : read_bit();
     uint16_t repeat = read_repeat_count();
 
     for (uint8_t x = 0; x < FRAME_WIDTH; x ++) {
-        for (uint8_t y = 0; y < FRAME_HEIGHT; y ++) {
-            // Skip chunks
-            if (y % CHUNK_HEIGHT == 0) {
-                uint8_t cx = std::min(x / CHUNK_WIDTH, CHUNK_COUNT_X - 1);
-                uint8_t cy = std::min(y / CHUNK_HEIGHT, CHUNK_COUNT_Y - 1);
-                // Check that the chunk is changed
-                if (!(header & (1ull << (cx * CHUNK_COUNT_Y + cy)))) {
-                    // Offset 1 for the loop
-                    y += CHUNK_HEIGHT - 1;
-                    continue;
-                }
+        // Changed flags of the chunks in this column, one bit per chunk
+        const uint8_t column_chunks = header >> (x / CHUNK_WIDTH * CHUNK_COUNT_Y);
+        // Every pixel of the column is in the same bit of the same byte of a row
+        const uint8_t lcd_x = x + FRAME_OFFSET_X;
+        const uint8_t mask = 0x80 >> (lcd_x % 8);
+
+        for (uint8_t cy = 0; cy < CHUNK_COUNT_Y && cy * CHUNK_HEIGHT < FRAME_HEIGHT; cy ++) {
+            // Skip unchanged chunks entirely
+            if (!(column_chunks & 1 << cy)) {
+                continue;
             }
-            // Get new repeat value if needed
-            if (repeat == 0) {
-                current = !current;
-                repeat = read_repeat_count();
+            uint8_t y = cy * CHUNK_HEIGHT;
+            const uint8_t yend = std::min<uint8_t>(y + CHUNK_HEIGHT, FRAME_HEIGHT);
+            // Apply the part of each run that falls in this chunk
+            while (y < yend) {
+                // Get new repeat value if needed
+                if (repeat == 0) {
+                    current = !current;
+                    repeat = read_repeat_count();
+                }
+                const uint8_t count = std::min<uint16_t>(repeat, yend - y);
+                fill_run(frame, lcd_x / 8, mask, y + FRAME_OFFSET_Y, count, current);
+                repeat -= count;
+                y += count;
             }
-            repeat --;
-
-            // Update LCD pixel
-            set_pixel(frame, x + FRAME_OFFSET_X, y + FRAME_OFFSET_Y, current);
         }
     }
     // Find border colours
     uint8_t l0 = 0, l1 = 0, r0 = 0, r1 = 0;
     for (uint8_t y = 0; y < FRAME_HEIGHT; y ++) {
-        (frame[y + FRAME_OFFSET_Y][FRAME_OFFSET_X / 8] & 1 << (7 - FRAME_OFFSET_X % 8) ? l1 : l0) ++;
-        (frame[y + FRAME_OFFSET_Y][(FRAME_OFFSET_X + FRAME_WIDTH - 1) / 8] & 1 << (7 - (FRAME_OFFSET_X + FRAME_WIDTH - 1) % 8) ? r1 : r0) ++;
+        (*framebuf::pixel_byte(frame, FRAME_OFFSET_X, y + FRAME_OFFSET_Y) & 1 << (7 - FRAME_OFFSET_X % 8) ? l1 : l0) ++;
+        (*framebuf::pixel_byte(frame, FRAME_OFFSET_X + FRAME_WIDTH - 1, y + FRAME_OFFSET_Y) & 1 << (7 - (FRAME_OFFSET_X + FRAME_WIDTH - 1) % 8) ? r1 : r0) ++;
     }
     const uint8_t RIGHT_OFFSET = 128 - FRAME_OFFSET_X - FRAME_WIDTH;
     if (std::abs(l1 - l0) >= 10) {
+        framebuf::mark_dirty(dirty, 0, 64, framebuf::word_span(0, FRAME_OFFSET_X + 1));
         for (uint8_t row = 0; row < 64; row ++) {
+            uint8_t *line = &frame[0][0] + framebuf::row_offset(row);
             for (uint8_t col = 0; col < FRAME_OFFSET_X / 8; col ++) {
-                frame[row][col] = l1 > l0 ? 0xFF : 0x00;
+                line[col] = l1 > l0 ? 0xFF : 0x00;
             }
             const uint8_t mask = 0xFF << (8 - FRAME_OFFSET_X % 8);
             if (l1 > l0) {
-                frame[row][FRAME_OFFSET_X / 8] |= mask;
+                line[FRAME_OFFSET_X / 8] |= mask;
             }
             else {
-                frame[row][FRAME_OFFSET_X / 8] &= ~mask;
+                line[FRAME_OFFSET_X / 8] &= ~mask;
             }
         }
     }
     if (std::abs(r1 - r0) >= 10) {
+        framebuf::mark_dirty(dirty, 0, 64, framebuf::word_span(FRAME_OFFSET_X + FRAME_WIDTH - 1, 128));
         for (uint8_t row = 0; row < 64; row ++) {
+            uint8_t *line = &frame[0][0] + framebuf::row_offset(row);
             for (uint8_t col = 16 - RIGHT_OFFSET / 8; col < 16; col ++) {
-                frame[row][col] = r1 > r0 ? 0xFF : 0x00;
+                line[col] = r1 > r0 ? 0xFF : 0x00;
             }
             const uint8_t mask = 0xFF >> (8 - RIGHT_OFFSET % 8);
             if (r1 > r0) {
-                frame[row][(FRAME_OFFSET_X + FRAME_WIDTH + 1) / 8] |= mask;
+                line[(FRAME_OFFSET_X + FRAME_WIDTH + 1) / 8] |= mask;
             }
             else {
-                frame[row][(FRAME_OFFSET_X + FRAME_WIDTH + 1) / 8] &= ~mask;
+                line[(FRAME_OFFSET_X + FRAME_WIDTH + 1) / 8] &= ~mask;
             }
         }
     }
@@ -2,13 +2,17 @@
 #include "delay.h"
 #include "util.h"
 
-#define SYSCLK_FREQUENCY 72 // MHz
-
 namespace delay {
     
     void cycles(uint32_t c) {
         while(c--);
     }
+
+    void init_cycle_counter() {
+        // Enable the trace unit (DEMCR.TRCENA), then the counter (DWT_CTRL.CYCCNTENA)
+        *reinterpret_cast<volatile uint32_t *>(0xE000EDFC) |= 0x01000000;
+        *reinterpret_cast<volatile uint32_t *>(0xE0001000) |= 0x00000001;
+    }
     
     void us(uint16_t microSeconds) {
         NoInterrupt noi;
@@ -0,0 +1,183 @@
+#include "gdramdma.h"
+
+namespace lcd {
+
+    // The engine that is currently sending, for the interrupt handler
+    static GDRAMDMA *active = nullptr;
+
+    // DMA1 channels requested by TIM1's compare channels
+    static DMA_Channel_TypeDef * const CC1_CHANNEL = DMA1_Channel2;
+    static DMA_Channel_TypeDef * const CC2_CHANNEL = DMA1_Channel3;
+    static DMA_Channel_TypeDef * const CC3_CHANNEL = DMA1_Channel6;
+    static DMA_Channel_TypeDef * const CC4_CHANNEL = DMA1_Channel4;
+
+    GDRAMDMA::GDRAMDMA(LCDBase &lcd) : lcd(lcd) {
+        if (lcd.FOUR_WIRE_INTERFACE) {
+            return;
+        }
+        // Every port with data pins or RS gets a stream
+        for (uint8_t i = 0; i < lcd.data_port_count; i ++) {
+            PortStream *stream = stream_for(lcd.data_ports[i].port);
+            if (!stream) {
+                return;
+            }
+            stream->table = &lcd.data_ports[i];
+        }
+        PortStream *rs_stream = stream_for(lcd.RS.port);
+        if (!rs_stream) {
+            return;
+        }
+        rs_stream->rs_high = lcd.RS.pin;
+        rs_stream->rs_low = static_cast<uint32_t>(lcd.RS.pin) << 16;
+        // Keep E low while the data changes, if it shares a port with it
+        for (uint8_t i = 0; i < stream_count; i ++) {
+            if (streams[i].port == lcd.E.port) {
+                streams[i].e_low = static_cast<uint32_t>(lcd.E.pin) << 16;
+            }
+        }
+        e_high_word = lcd.E.pin;
+        e_low_word = static_cast<uint32_t>(lcd.E.pin) << 16;
+        supported = true;
+    }
+
+    GDRAMDMA::PortStream* GDRAMDMA::stream_for(GPIO_TypeDef *port) {
+        for (uint8_t i = 0; i < stream_count; i ++) {
+            if (streams[i].port == port) {
+                return &streams[i];
+            }
+        }
+        if (stream_count == 2) {
+            return nullptr;
+        }
+        streams[stream_count] = { port, nullptr, 0, 0, 0 };
+        return &streams[stream_count ++];
+    }
+
+    bool GDRAMDMA::is_supported() const {
+        return supported;
+    }
+    bool GDRAMDMA::is_busy() const {
+        return busy;
+    }
+
+    void GDRAMDMA::init_hardware() {
+        RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
+
+        TIM_TimeBaseInitTypeDef base_init = {
+            // 72MHz / 72 = 1MHz
+            .TIM_Prescaler = 72 - 1,
+            .TIM_CounterMode = TIM_CounterMode_Up,
+            // One write per period
+            .TIM_Period = LCD_EXEC_TIME - 1,
+            .TIM_ClockDivision = TIM_CKD_DIV1,
+            .TIM_RepetitionCounter = 0,
+        };
+        TIM_TimeBaseInit(TIM1, &base_init);
+        // The compare channels only generate DMA requests; their outputs stay off
+        TIM_OCInitTypeDef oc_init;
+        TIM_OCStructInit(&oc_init);
+        oc_init.TIM_OCMode = TIM_OCMode_Timing;
+        oc_init.TIM_Pulse = 1;
+        TIM_OC1Init(TIM1, &oc_init);
+        oc_init.TIM_Pulse = 2;
+        TIM_OC2Init(TIM1, &oc_init);
+        oc_init.TIM_Pulse = 3;
+        TIM_OC3Init(TIM1, &oc_init);
+        oc_init.TIM_Pulse = 4;
+        TIM_OC4Init(TIM1, &oc_init);
+
+        DMA_ITConfig(CC4_CHANNEL, DMA_IT_TC, ENABLE);
+        NVIC_InitTypeDef nvic_init = {
+            .NVIC_IRQChannel = DMA1_Channel4_IRQn,
+            .NVIC_IRQChannelPreemptionPriority = 1,
+            .NVIC_IRQChannelSubPriority = 1,
+            .NVIC_IRQChannelCmd = ENABLE,
+        };
+        NVIC_Init(&nvic_init);
+        hardware_ready = true;
+    }
+
+    // Set up a DMA channel to copy count words to a BSRR, one per request
+    static void start_channel(DMA_Channel_TypeDef *channel, GPIO_TypeDef *port, const uint32_t *words,
+            uint16_t count, bool increment) {
+        DMA_Cmd(channel, DISABLE);
+        DMA_InitTypeDef init;
+        init.DMA_PeripheralBaseAddr = reinterpret_cast<uintptr_t>(&port->BSRR);
+        init.DMA_MemoryBaseAddr = reinterpret_cast<uintptr_t>(words);
+        init.DMA_DIR = DMA_DIR_PeripheralDST;
+        init.DMA_BufferSize = count;
+        init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        init.DMA_MemoryInc = increment ? DMA_MemoryInc_Enable : DMA_MemoryInc_Disable;
+        init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+        init.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+        init.DMA_Mode = DMA_Mode_Normal;
+        init.DMA_Priority = DMA_Priority_High;
+        init.DMA_M2M = DMA_M2M_Disable;
+        DMA_Init(channel, &init);
+        DMA_Cmd(channel, ENABLE);
+    }
+
+    void GDRAMDMA::start(const BusWrite *writes, uint16_t count) {
+        if (!count) {
+            return;
+        }
+        if (!hardware_ready) {
+            init_hardware();
+        }
+        // Turn every write into the BSRR word for each port
+        for (uint8_t s = 0; s < stream_count; s ++) {
+            const PortStream &stream = streams[s];
+            uint32_t *out = words[s];
+            for (uint16_t i = 0; i < count; i ++) {
+                const uint8_t value = writes[i].value;
+                uint32_t word = stream.e_low | (writes[i].data ? stream.rs_high : stream.rs_low);
+                if (stream.table) {
+                    word |= stream.table->low[value & 0x0F] | stream.table->high[value >> 4];
+                }
+                out[i] = word;
+            }
+        }
+
+        busy = true;
+        active = this;
+        lcd.RW = false;
+        lcd.E = false;
+
+        start_channel(CC1_CHANNEL, streams[0].port, words[0], count, true);
+        uint16_t requests = TIM_DMA_CC1 | TIM_DMA_CC3 | TIM_DMA_CC4;
+        if (stream_count > 1) {
+            start_channel(CC2_CHANNEL, streams[1].port, words[1], count, true);
+            requests |= TIM_DMA_CC2;
+        }
+        start_channel(CC3_CHANNEL, lcd.E.port, &e_high_word, count, false);
+        start_channel(CC4_CHANNEL, lcd.E.port, &e_low_word, count, false);
+
+        TIM_SetCounter(TIM1, 0);
+        TIM_DMACmd(TIM1, requests, ENABLE);
+        TIM_Cmd(TIM1, ENABLE);
+    }
+
+    void GDRAMDMA::complete() {
+        TIM_Cmd(TIM1, DISABLE);
+        TIM_DMACmd(TIM1, TIM_DMA_CC1 | TIM_DMA_CC2 | TIM_DMA_CC3 | TIM_DMA_CC4, DISABLE);
+        DMA_Cmd(CC1_CHANNEL, DISABLE);
+        DMA_Cmd(CC2_CHANNEL, DISABLE);
+        DMA_Cmd(CC3_CHANNEL, DISABLE);
+        DMA_Cmd(CC4_CHANNEL, DISABLE);
+        // The last write is still executing
+        lcd.set_busy_for(LCD_EXEC_TIME);
+        busy = false;
+        active = nullptr;
+    }
+} // namespace lcd
+
+// Transfer complete interrupt for the channel that lowers E
+extern "C" void DMA1_Channel4_IRQHandler() {
+    if (DMA_GetITStatus(DMA1_IT_TC4)) {
+        DMA_ClearITPendingBit(DMA1_IT_GL4);
+        if (lcd::active) {
+            lcd::active->complete();
+        }
+    }
+}
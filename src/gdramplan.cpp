@@ -0,0 +1,88 @@
+#include "gdramplan.h"
+
+namespace lcd {
+
+    uint16_t plan_gdram_update(const framebuf::Frame draw_buf, GDRAMState &display, uint8_t scroll,
+            const framebuf::DirtyMask &dirty, BusWrite *writes, const BusCost &cost, BusStats *stats) {
+        const uint8_t *draw = &draw_buf[0][0];
+        scroll %= 64;
+        // Every screen row shows a different GDRAM row after a scroll
+        const bool scrolled = scroll != display.scroll;
+        // Bridge a gap if rewriting its words costs no more than setting the address again
+        // Both cost two writes per unit, so the 2s cancel out
+        const uint32_t readdress_cost = cost.command;
+        uint16_t count = 0;
+        uint32_t commands = 0;
+        for (uint8_t row = 0; row < 32; row ++) {
+            const uint16_t row_dirty = scrolled ? 0xFFFF : dirty[row];
+            // Skip rows with nothing to compare
+            if (!row_dirty) {
+                continue;
+            }
+            // The GDRAM row that screen rows row and row + 32 show
+            const uint8_t gdram_row = (row + scroll) % 64;
+            uint8_t *ram = display.ram[gdram_row];
+            // Find the words that changed and update the display buffer
+            // Words outside the dirty mask are known to be the same
+            uint16_t changed = 0;
+            for (uint8_t col = 0; col < 16; col ++) {
+                if (!(row_dirty & 1 << col)) {
+                    continue;
+                }
+                // With the GDRAM layout this is just the next word in the buffer
+                uint16_t offset = framebuf::word_offset(row, col);
+                if (ram[col * 2] != draw[offset] || ram[col * 2 + 1] != draw[offset + 1]) {
+                    ram[col * 2] = draw[offset];
+                    ram[col * 2 + 1] = draw[offset + 1];
+                    changed |= 1 << col;
+                }
+            }
+
+            // The address auto-increments, so it only needs to be set at the start of a run
+            bool run = false;
+            for (uint8_t col = 0; changed >> col; col ++) {
+                if (!(changed & 1 << col)) {
+                    if (!run) {
+                        continue;
+                    }
+                    // Measure the gap up to the next changed word
+                    uint8_t gap = 1;
+                    while (!(changed & 1 << (col + gap))) {
+                        gap ++;
+                    }
+                    if (static_cast<uint32_t>(gap) * cost.data > readdress_cost) {
+                        run = false;
+                        col += gap - 1;
+                        continue;
+                    }
+                    // Rewriting what's already there is harmless; fall through and bridge the gap
+                }
+                if (!run) {
+                    run = true;
+                    writes[count ++] = { static_cast<uint8_t>(0x80 | gdram_row), false };
+                    writes[count ++] = { static_cast<uint8_t>(0x80 | col), false };
+                    commands += 2;
+                }
+                // Write higher order byte first
+                writes[count ++] = { ram[col * 2], true };
+                writes[count ++] = { ram[col * 2 + 1], true };
+            }
+        }
+        if (scrolled) {
+            if (!display.scroll_enabled) {
+                // EXT_ENABLE_SCROLL: the next command sets the scroll address rather than the IRAM address
+                writes[count ++] = { 0x03, false };
+                commands ++;
+                display.scroll_enabled = true;
+            }
+            writes[count ++] = { static_cast<uint8_t>(0x40 | scroll), false };
+            commands ++;
+            display.scroll = scroll;
+        }
+        if (stats) {
+            stats->commands += commands;
+            stats->data += count - commands;
+        }
+        return count;
+    }
+} // namespace lcd
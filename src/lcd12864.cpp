@@ -101,11 +101,20 @@ namespace lcd {
             return;
         }
         
-        for(uint8_t row = 0; row < 32; row ++) {
+        for(uint8_t row = 0; row < 64; row ++) {
             for(uint8_t col = 0; col < 16; col ++) {
                 // The row gets written first
-                // There are 32 rows (bottom 32 are just extensions of the top 32)
+                // There are 64 rows; 32 are on screen (bottom 32 are just extensions of the top 32), and the rest
+                // can be scrolled in
                 // And then the column gets written (16 pixels)
+                // Queued writes are sent in the background, and only have to be done by the end
+                if (queued_mode) {
+                    queue.push({ static_cast<uint8_t>(0x80 | row), false });
+                    queue.push({ static_cast<uint8_t>(0x80 | col), false });
+                    queue.push({ 0x00, true });
+                    queue.push({ 0x00, true });
+                    continue;
+                }
                 NoInterrupt noi;
                 write_cmd(0x80 | row);
                 write_cmd(0x80 | col);
@@ -113,42 +122,75 @@ namespace lcd {
                 write_data(0x00);
             }
         }
-        memset(display_buf, 0, sizeof(display_buf));
+        flush();
+        memset(display_buf.ram, 0, sizeof(display_buf.ram));
         memset(draw_buf, 0, sizeof(draw_buf));
     }
     
     // This function takes the drawing buffer, compares it with the display buffer and writes any necessary bytes.
     void LCD12864::update_drawing() {
+        static const framebuf::DirtyMask ALL_DIRTY = {
+            0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+            0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+            0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+            0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+        };
+        update_drawing(ALL_DIRTY);
+    }
+    void LCD12864::update_drawing(const framebuf::DirtyMask &dirty) {
         if (!is_drawing()) {
             return;
         }
-        for (uint8_t row = 0; row < 32; row ++) {
-            bool run = false;
-            for (uint8_t col = 0; col < 16; col ++) {
-                // Convert coordinates
-                uint8_t buf_row = col >= 8 ? row + 32 : row;
-                uint8_t buf_col = (col >= 8 ? col - 8 : col) * 2;
-
-                // Compare display and draw buffers
-                if (display_buf[buf_row][buf_col] != draw_buf[buf_row][buf_col]
-                        || display_buf[buf_row][buf_col + 1] != draw_buf[buf_row][buf_col + 1]) {
-                    // Update the display buffer
-                    display_buf[buf_row][buf_col] = draw_buf[buf_row][buf_col];
-                    display_buf[buf_row][buf_col + 1] = draw_buf[buf_row][buf_col + 1];
-                    NoInterrupt noi;
-                    if (!run) {
-                        run = true;
-                        write_cmd(0x80 | row);
-                        write_cmd(0x80 | col);
-                    }
-                    // Write higher order byte first
-                    write_data(display_buf[buf_row][buf_col]);
-                    write_data(display_buf[buf_row][buf_col + 1]);
-                }
-                else {
-                    run = false;
-                }
+        // Let a background update finish first
+        while (is_updating()) {}
+        uint16_t count = plan_gdram_update(draw_buf, display_buf, scroll, dirty, gdram_writes, bus_cost, &bus_stats);
+        // Queued writes are sent in the background; this only waits if the queue fills up
+        if (queued_mode) {
+            for (uint16_t i = 0; i < count; i ++) {
+                queue.push(gdram_writes[i]);
             }
+            return;
+        }
+        for (uint16_t i = 0; i < count; i ++) {
+            NoInterrupt noi;
+            if (gdram_writes[i].data) {
+                write_data(gdram_writes[i].value);
+            }
+            else {
+                write_cmd(gdram_writes[i].value);
+            }
+        }
+    }
+    void LCD12864::start_update_drawing(const framebuf::DirtyMask &dirty) {
+        if (!dma.is_supported()) {
+            update_drawing(dirty);
+            return;
+        }
+        if (!is_drawing()) {
+            return;
         }
+        while (is_updating()) {}
+        uint16_t count = plan_gdram_update(draw_buf, display_buf, scroll, dirty, gdram_writes, bus_cost, &bus_stats);
+        // The engine doesn't check the busy flag, so the last operation has to be done
+        flush();
+        wait_ready();
+        dma.start(gdram_writes, count);
+    }
+    bool LCD12864::is_updating() {
+        return dma.is_busy();
+    }
+
+    void LCD12864::scroll_by(int8_t lines) {
+        scroll = (scroll + lines) & 63;
+    }
+
+    void LCD12864::set_bus_cost(const BusCost &cost) {
+        bus_cost = cost;
+    }
+    const BusStats& LCD12864::get_bus_stats() {
+        return bus_stats;
+    }
+    void LCD12864::reset_bus_stats() {
+        bus_stats = {};
     }
 }
@@ -11,10 +11,11 @@ namespace lcd {
     const GPIOConfig LCDBase::WRITE_CONFIG = { GPIO_Mode_Out_PP, GPIO_Speed_50MHz };
     
     #define LCD_EDELAY() delay::cycles(LCD_ENABLE_DELAY)
-    #define INIT_I(x) x.init(GPIO_Mode_IPU, GPIO_Speed_10MHz)
     #define INIT_O(x) x.init(GPIO_Mode_Out_PP, GPIO_Speed_10MHz)
     
     void LCDBase::init_GPIO() {
+        init_data_ports();
+
         // Initialize the pins for output first
         INIT_O(RS);
         INIT_O(RW);
@@ -28,19 +29,147 @@ namespace lcd {
         RW = false;
         E = false;
     }
+    // Mask of the CRL (lower 8 pins) or CRH (upper 8 pins) configuration fields of a set of pins
+    static uint32_t config_mask(uint8_t pins) {
+        uint32_t mask = 0;
+        for(uint8_t i = 0; i < 8; i ++) {
+            if(pins & 1 << i) {
+                mask |= 0xFu << (i * 4);
+            }
+        }
+        return mask;
+    }
+
+    void LCDBase::set_pins_mode(GPIO_TypeDef *port, uint16_t pins, uint32_t crl_mask, uint32_t crh_mask,
+            const GPIOConfig &config) {
+        // Same encoding as GPIO_Init: CNF bits come from the mode, MODE bits from the speed if it's an output
+        uint32_t field = config.mode & 0x0F;
+        if(config.mode & 0x10) {
+            field |= config.speed;
+        }
+        // Copy the field to every pin, then keep only the data pins
+        field *= 0x11111111;
+        if(crl_mask) {
+            port->CRL = (port->CRL & ~crl_mask) | (field & crl_mask);
+        }
+        if(crh_mask) {
+            port->CRH = (port->CRH & ~crh_mask) | (field & crh_mask);
+        }
+        // The pull direction of an input is set through the output register
+        if(config.mode == GPIO_Mode_IPU) {
+            port->BSRR = pins;
+        }
+        else if(config.mode == GPIO_Mode_IPD) {
+            port->BRR = pins;
+        }
+    }
+
+    // Build the BSRR tables used by set_data_port
+    void LCDBase::init_data_ports() {
+        // In four wire interface, bits 0-3 of the port value go to D4-D7
+        GPIOPin *pins[8] = { &D0, &D1, &D2, &D3, &D4, &D5, &D6, &D7 };
+        GPIOPin **data_pins = FOUR_WIRE_INTERFACE ? pins + 4 : pins;
+        const uint8_t pin_count = FOUR_WIRE_INTERFACE ? 4 : 8;
+
+        data_port_count = 0;
+        for(uint8_t bit = 0; bit < pin_count; bit ++) {
+            const GPIOPin &pin = *data_pins[bit];
+            // Find the table for this pin's port, or start a new one
+            DataPortTable *table = nullptr;
+            for(uint8_t i = 0; i < data_port_count; i ++) {
+                if(data_ports[i].port == pin.port) {
+                    table = &data_ports[i];
+                    break;
+                }
+            }
+            if(!table) {
+                table = &data_ports[data_port_count ++];
+                table->port = pin.port;
+                memset(table->low, 0, sizeof(table->low));
+                memset(table->high, 0, sizeof(table->high));
+                table->pins = 0;
+                RCC_APB2PeriphClockCmd(pin.get_RCC_perhiph(), ENABLE);
+            }
+            table->pins |= pin.pin;
+            // Set the pin for nibble values with the bit set, and reset it (upper half of BSRR) otherwise
+            uint32_t *nibble_table = bit < 4 ? table->low : table->high;
+            for(uint8_t value = 0; value < 16; value ++) {
+                nibble_table[value] |= value & (1 << bit % 4) ? pin.pin : static_cast<uint32_t>(pin.pin) << 16;
+            }
+        }
+        for(uint8_t i = 0; i < data_port_count; i ++) {
+            data_ports[i].crl_mask = config_mask(data_ports[i].pins & 0xFF);
+            data_ports[i].crh_mask = config_mask(data_ports[i].pins >> 8);
+        }
+        busy_crl_mask = config_mask(D7.pin & 0xFF);
+        busy_crh_mask = config_mask(D7.pin >> 8);
+    }
+
     void LCDBase::set_GPIO_mode(const GPIOConfig &config) {
-        if(!FOUR_WIRE_INTERFACE) {
-            D0.init(config);
-            D1.init(config);
-            D2.init(config);
-            D3.init(config);
+        for(uint8_t i = 0; i < data_port_count; i ++) {
+            const DataPortTable &table = data_ports[i];
+            set_pins_mode(table.port, table.pins, table.crl_mask, table.crh_mask, config);
         }
-        D4.init(config);
-        D5.init(config);
-        D6.init(config);
-        D7.init(config);
     }
     
+    bool LCDBase::is_timed_mode() {
+        return timed_mode;
+    }
+    void LCDBase::set_timed_mode(bool timed) {
+        if(timed && !timed_mode) {
+            delay::init_cycle_counter();
+            ready_time = delay::cycle_count();
+        }
+        timed_mode = timed;
+    }
+
+    bool LCDBase::is_queued_mode() {
+        return queued_mode;
+    }
+    void LCDBase::set_queued_mode(bool queued) {
+        if(!queued) {
+            flush();
+        }
+        queued_mode = queued;
+    }
+    bool LCDBase::queue_cmd(uint8_t cmd) {
+        if(!queued_mode) {
+            write_cmd(cmd);
+            return true;
+        }
+        return queue.try_push({ cmd, false });
+    }
+    bool LCDBase::queue_data(uint8_t data) {
+        if(!queued_mode) {
+            write_data(data);
+            return true;
+        }
+        return queue.try_push({ data, true });
+    }
+    void LCDBase::flush() {
+        queue.flush();
+    }
+    const LCDQueue::Stats& LCDBase::get_queue_stats() {
+        return queue.get_stats();
+    }
+    uint16_t LCDBase::get_queue_depth() {
+        return queue.depth();
+    }
+
+    void LCDBase::wait_ready() {
+        if(!timed_mode) {
+            wait_busy();
+            return;
+        }
+        // Signed difference so the counter wrapping around doesn't matter
+        while(static_cast<int32_t>(ready_time - delay::cycle_count()) > 0);
+    }
+    void LCDBase::set_busy_for(uint16_t us) {
+        if(timed_mode) {
+            ready_time = delay::cycle_count() + us * SYSCLK_FREQUENCY;
+        }
+    }
+
     uint32_t LCDBase::get_timeout() {
         return this->timeout;
     }
@@ -51,22 +180,13 @@ namespace lcd {
     // These functions set and read from the data port
     // If in four wire interface, only the lowest 4 bits will be written
     void LCDBase::set_data_port(uint8_t data) {
-        if(!FOUR_WIRE_INTERFACE) {
-            D0 = data & 0x01;
-            D1 = data & 0x02;
-            D2 = data & 0x04;
-            D3 = data & 0x08;
-            D4 = data & 0x10;
-            D5 = data & 0x20;
-            D6 = data & 0x40;
-            D7 = data & 0x80;
-        }
-        else {
+        if(FOUR_WIRE_INTERFACE) {
             data &= 0x0F;
-            D4 = data & 0x01;
-            D5 = data & 0x02;
-            D6 = data & 0x04;
-            D7 = data & 0x08;
+        }
+        // One store per port; the high tables are empty in four wire interface
+        for(uint8_t i = 0; i < data_port_count; i ++) {
+            const DataPortTable &table = data_ports[i];
+            table.port->BSRR = table.low[data & 0x0F] | table.high[data >> 4];
         }
     }
     // If in four wire interface, only a nibble will be read
@@ -93,7 +213,7 @@ namespace lcd {
             LCD_EDELAY();
         }
         // Initialize to read the busy flag
-        INIT_I(D7);
+        set_pins_mode(D7.port, D7.pin, busy_crl_mask, busy_crh_mask, READ_CONFIG);
         // Wait until the pin is cleared
         while(D7) {
             {
@@ -111,88 +231,66 @@ namespace lcd {
             }
         }
         E = false;
-        INIT_O(D7);
+        set_pins_mode(D7.port, D7.pin, busy_crl_mask, busy_crh_mask, WRITE_CONFIG);
     }
     
         
-    void LCDBase::write_cmd(uint8_t cmd) {
-        wait_busy();
-
-        NoInterrupt noi;
-        RS = false;
+    void LCDBase::send(uint8_t value, bool data) {
+        RS = data;
         RW = false;
         
         if(FOUR_WIRE_INTERFACE) {
-            set_data_port(cmd >> 4);
+            set_data_port(value >> 4);
             E = true;
             LCD_EDELAY();
             E = false;
-            set_data_port(cmd & 0x0F);
+            set_data_port(value & 0x0F);
             LCD_EDELAY();
             E = true;
             LCD_EDELAY();
             E = false;
         }
         else {
-            set_data_port(cmd);
+            set_data_port(value);
             E = true;
             LCD_EDELAY();
             E = false;
         }
+        extended_set = next_instruction_set(value, data, extended_set);
+        set_busy_for(exec_time(value, data, extended_set));
+    }
+
+    void LCDBase::write_cmd(uint8_t cmd) {
+        if(queued_mode) {
+            queue.push({ cmd, false });
+            queue.flush();
+            return;
+        }
+        wait_ready();
+
+        NoInterrupt noi;
+        send(cmd, false);
     }
     // The busy flag cannot be checked before initialization, thus delays are used instead of busy flag checking
     void LCDBase::write_cmd_no_wait(uint8_t cmd) {
         NoInterrupt noi;
-
-        RS = false;
-        RW = false;
-        
-        if(FOUR_WIRE_INTERFACE) {
-            set_data_port(cmd >> 4);
-            E = true;
-            LCD_EDELAY();
-            E = false;
-            set_data_port(cmd & 0x0F);
-            LCD_EDELAY();
-            E = true;
-            LCD_EDELAY();
-            E = false;
-        }
-        else {
-            set_data_port(cmd);
-            E = true;
-            LCD_EDELAY();
-            E = false;
-        }
+        send(cmd, false);
     }
     void LCDBase::write_data(uint8_t data) {
-        wait_busy();
+        if(queued_mode) {
+            queue.push({ data, true });
+            queue.flush();
+            return;
+        }
+        wait_ready();
 
         NoInterrupt noi;
-
-        RS = true;
-        RW = false;
-        
-        if(FOUR_WIRE_INTERFACE) {
-            set_data_port(data >> 4);
-            E = true;
-            LCD_EDELAY();
-            E = false;
-            set_data_port(data & 0x0F);
-            LCD_EDELAY();
-            E = true;
-            LCD_EDELAY();
-            E = false;
-        }
-        else {
-            set_data_port(data);
-            E = true;
-            LCD_EDELAY();
-            E = false;
-        }
+        send(data, true);
     }
     uint8_t LCDBase::read_data() {
-        wait_busy();
+        // Reads can't be queued, but everything before them has to be done
+        flush();
+        wait_ready();
 
         NoInterrupt noi;
 
@@ -217,6 +315,7 @@ namespace lcd {
             out = read_data_port();
             E = false;
         }
+        set_busy_for(LCD_EXEC_TIME);
         return out;
     }
     void LCDBase::write_str(const char *str) {
@@ -237,6 +336,5 @@ namespace lcd {
     }
     
     #undef LCD_EDELAY
-    #undef INIT_I
     #undef INIT_O
 }
@@ -0,0 +1,157 @@
+#include "lcdqueue.h"
+#include "lcdbase.h"
+#include "util.h"
+
+namespace lcd {
+
+    // The queue the timer interrupt is sending from
+    static LCDQueue *active = nullptr;
+
+    void LCDQueue::init_hardware() {
+        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
+        TIM_TimeBaseInitTypeDef base_init = {
+            // 72MHz / 72 = 1MHz
+            .TIM_Prescaler = 72 - 1,
+            .TIM_CounterMode = TIM_CounterMode_Up,
+            .TIM_Period = LCD_EXEC_TIME - 1,
+            .TIM_ClockDivision = TIM_CKD_DIV1,
+            .TIM_RepetitionCounter = 0,
+        };
+        TIM_TimeBaseInit(TIM4, &base_init);
+        // The counter stops by itself after every period; the interrupt restarts it if there is more to send
+        TIM_SelectOnePulseMode(TIM4, TIM_OPMode_Single);
+        TIM_ClearITPendingBit(TIM4, TIM_IT_Update);
+        TIM_ITConfig(TIM4, TIM_IT_Update, ENABLE);
+        // Lower priority than the frame timer, so sending never delays a tick
+        NVIC_InitTypeDef nvic_init = {
+            .NVIC_IRQChannel = TIM4_IRQn,
+            .NVIC_IRQChannelPreemptionPriority = 3,
+            .NVIC_IRQChannelSubPriority = 1,
+            .NVIC_IRQChannelCmd = ENABLE,
+        };
+        NVIC_Init(&nvic_init);
+        hardware_ready = true;
+    }
+
+    uint16_t LCDQueue::depth() const {
+        return (tail - head) & (LCD_QUEUE_SIZE - 1);
+    }
+    bool LCDQueue::is_idle() const {
+        return !running;
+    }
+    const LCDQueue::Stats& LCDQueue::get_stats() const {
+        return stats;
+    }
+    void LCDQueue::reset_stats() {
+        stats = {};
+    }
+
+    bool LCDQueue::enqueue(BusWrite write) {
+        uint16_t next = (tail + 1) & (LCD_QUEUE_SIZE - 1);
+        // One slot is kept empty to tell a full queue from an empty one
+        if (next == head) {
+            return false;
+        }
+        ring[tail] = write;
+        // The write must be in the ring before the interrupt can see it
+        __DMB();
+        tail = next;
+
+        uint16_t d = depth();
+        if (d > stats.max_depth) {
+            stats.max_depth = d;
+        }
+        kick();
+        return true;
+    }
+    bool LCDQueue::try_push(BusWrite write) {
+        if (!enqueue(write)) {
+            stats.stalls ++;
+            return false;
+        }
+        return true;
+    }
+    void LCDQueue::push(BusWrite write) {
+        if (enqueue(write)) {
+            return;
+        }
+        stats.stalls ++;
+        const bool caller_masked = __get_PRIMASK();
+        while (true) {
+            // Checked with interrupts masked, so the interrupt can't make room between the check and the sleep
+            NoInterrupt noi;
+            if (enqueue(write)) {
+                return;
+            }
+            wait_for_service(caller_masked);
+        }
+    }
+    void LCDQueue::flush() {
+        const bool caller_masked = __get_PRIMASK();
+        while (true) {
+            NoInterrupt noi;
+            if (!running) {
+                return;
+            }
+            wait_for_service(caller_masked);
+        }
+    }
+
+    void LCDQueue::wait_for_service(bool caller_masked) {
+        if (!caller_masked) {
+            // WFI still wakes up for an interrupt that is pending while they're masked, and it's taken as soon as
+            // the caller unmasks them
+            __WFI();
+            return;
+        }
+        // The interrupt can't run until the caller is done, so do its work here when the timer goes off
+        // Its pending bit in the NVIC stays set, but the handler finds the update flag cleared and does nothing
+        if (TIM_GetITStatus(TIM4, TIM_IT_Update)) {
+            TIM_ClearITPendingBit(TIM4, TIM_IT_Update);
+            service();
+        }
+    }
+
+    void LCDQueue::kick() {
+        // The interrupt only clears running after finding the queue empty, and it can't run in the middle of this
+        // check; so either it will still see the new write, or it has stopped and has to be restarted
+        if (running) {
+            return;
+        }
+        if (!hardware_ready) {
+            init_hardware();
+        }
+        // Anything sent directly must be done before the interrupt takes over the bus
+        lcd.wait_ready();
+        running = true;
+        active = this;
+        // An update event calls the interrupt right away
+        TIM_GenerateEvent(TIM4, TIM_EventSource_Update);
+    }
+
+    void LCDQueue::service() {
+        if (head == tail) {
+            // The last write has had its execution time; the controller is ready
+            running = false;
+            return;
+        }
+        BusWrite write = ring[head];
+        head = (head + 1) & (LCD_QUEUE_SIZE - 1);
+        lcd.send(write.value, write.data);
+        stats.sent ++;
+        // Go off again when the controller can take the next write
+        TIM_SetAutoreload(TIM4, exec_time(write.value, write.data, lcd.extended_set) - 1);
+        TIM_SetCounter(TIM4, 0);
+        TIM_Cmd(TIM4, ENABLE);
+    }
+} // namespace lcd
+
+// Interrupt handler for TIM4 (LCD queue)
+extern "C" void TIM4_IRQHandler() {
+    if (TIM_GetITStatus(TIM4, TIM_IT_Update)) {
+        TIM_ClearITPendingBit(TIM4, TIM_IT_Update);
+        if (lcd::active) {
+            lcd::active->service();
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#include "lcdserial.h"
+#include "delay.h"
+#include "lcdbase.h"
+
+namespace lcd {
+
+    // The bus that is currently sending, for the interrupt handler
+    static SerialLCDBus *active = nullptr;
+
+    SerialLCDBus::SerialLCDBus(SPI_TypeDef *spi, GPIOPin CS) : spi(spi), CS(CS) {
+        init_hardware();
+    }
+
+    void SerialLCDBus::init_hardware() {
+        GPIOPin SCK, MOSI;
+        uint16_t prescaler;
+        // The DMA channels are the ones TIM1's requests are wired to; they're also the SPIs' own TX channels
+        if (spi == SPI1) {
+            SCK = GPIOPin(GPIOA, GPIO_Pin_5);
+            MOSI = GPIOPin(GPIOA, GPIO_Pin_7);
+            timer_request = TIM_DMA_CC2;
+            dma_channel = DMA1_Channel3;
+            dma_irq = DMA1_Channel3_IRQn;
+            RCC_APB2PeriphClockCmd(RCC_APB2Periph_SPI1, ENABLE);
+            // 72MHz / 64 = 1.125MHz
+            prescaler = SPI_BaudRatePrescaler_64;
+        }
+        else {
+            SCK = GPIOPin(GPIOB, GPIO_Pin_13);
+            MOSI = GPIOPin(GPIOB, GPIO_Pin_15);
+            timer_request = TIM_DMA_Update;
+            dma_channel = DMA1_Channel5;
+            dma_irq = DMA1_Channel5_IRQn;
+            RCC_APB1PeriphClockCmd(RCC_APB1Periph_SPI2, ENABLE);
+            // 36MHz / 32 = 1.125MHz
+            prescaler = SPI_BaudRatePrescaler_32;
+        }
+        RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
+        SCK.init(GPIO_Mode_AF_PP, GPIO_Speed_10MHz);
+        MOSI.init(GPIO_Mode_AF_PP, GPIO_Speed_10MHz);
+        CS.init(GPIO_Mode_Out_PP, GPIO_Speed_2MHz);
+        CS = true;
+
+        // The ST7920 samples SID on the rising edge of SCLK, which idles low
+        SPI_InitTypeDef spi_init;
+        SPI_StructInit(&spi_init);
+        spi_init.SPI_Direction = SPI_Direction_1Line_Tx;
+        spi_init.SPI_Mode = SPI_Mode_Master;
+        spi_init.SPI_DataSize = SPI_DataSize_8b;
+        spi_init.SPI_CPOL = SPI_CPOL_Low;
+        spi_init.SPI_CPHA = SPI_CPHA_1Edge;
+        spi_init.SPI_NSS = SPI_NSS_Soft;
+        spi_init.SPI_BaudRatePrescaler = prescaler;
+        spi_init.SPI_FirstBit = SPI_FirstBit_MSB;
+        SPI_Init(spi, &spi_init);
+        SPI_Cmd(spi, ENABLE);
+
+        TIM_TimeBaseInitTypeDef base_init = {
+            // 72MHz / 72 = 1MHz
+            .TIM_Prescaler = 72 - 1,
+            .TIM_CounterMode = TIM_CounterMode_Up,
+            // One byte per period
+            .TIM_Period = SERIAL_BYTE_PERIOD - 1,
+            .TIM_ClockDivision = TIM_CKD_DIV1,
+            .TIM_RepetitionCounter = 0,
+        };
+        TIM_TimeBaseInit(TIM1, &base_init);
+        if (timer_request == TIM_DMA_CC2) {
+            // The compare channel only generates DMA requests, at the same point as the update; its output stays off
+            TIM_OCInitTypeDef oc_init;
+            TIM_OCStructInit(&oc_init);
+            oc_init.TIM_OCMode = TIM_OCMode_Timing;
+            oc_init.TIM_Pulse = SERIAL_BYTE_PERIOD - 1;
+            TIM_OC2Init(TIM1, &oc_init);
+        }
+        // The ready time is kept in cycles
+        delay::init_cycle_counter();
+        ready_time = delay::cycle_count();
+
+        // The end of a transfer has to wake up the CPU, which sleeps while the display is updating
+        // DMA_Init() leaves the interrupt enable bits alone, so this lasts across transfers
+        DMA_ITConfig(dma_channel, DMA_IT_TC, ENABLE);
+        NVIC_InitTypeDef nvic_init = {
+            .NVIC_IRQChannel = dma_irq,
+            .NVIC_IRQChannelPreemptionPriority = 1,
+            .NVIC_IRQChannelSubPriority = 1,
+            .NVIC_IRQChannelCmd = ENABLE,
+        };
+        NVIC_Init(&nvic_init);
+    }
+
+    bool SerialLCDBus::is_sending() {
+        // The last write is still being shifted out and executed when the DMA is done, but the next update waits
+        // for that itself, so the bus is free for it already
+        return sending;
+    }
+
+    void SerialLCDBus::wait_ready() {
+        while (static_cast<int32_t>(ready_time - delay::cycle_count()) > 0) {}
+    }
+
+    void SerialLCDBus::send_writes(const BusWrite *writes, uint16_t count) {
+        while (is_sending()) {}
+        if (!count) {
+            return;
+        }
+        uint16_t size = encode_serial(writes, count, buffer);
+
+        DMA_InitTypeDef init;
+        init.DMA_PeripheralBaseAddr = reinterpret_cast<uintptr_t>(&spi->DR);
+        init.DMA_MemoryBaseAddr = reinterpret_cast<uintptr_t>(buffer);
+        init.DMA_DIR = DMA_DIR_PeripheralDST;
+        init.DMA_BufferSize = size;
+        init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        init.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+        init.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+        init.DMA_Mode = DMA_Mode_Normal;
+        init.DMA_Priority = DMA_Priority_Medium;
+        init.DMA_M2M = DMA_M2M_Disable;
+        DMA_Init(dma_channel, &init);
+
+        wait_ready();
+        sending = true;
+        active = this;
+        DMA_Cmd(dma_channel, ENABLE);
+        TIM_SetCounter(TIM1, 0);
+        TIM_DMACmd(TIM1, timer_request, ENABLE);
+        TIM_Cmd(TIM1, ENABLE);
+    }
+
+    void SerialLCDBus::complete() {
+        TIM_Cmd(TIM1, DISABLE);
+        TIM_DMACmd(TIM1, timer_request, DISABLE);
+        DMA_Cmd(dma_channel, DISABLE);
+        // The last byte has only just been handed to the SPI, and then the last write has to execute
+        ready_time = delay::cycle_count() + (SERIAL_BYTE_TIME + LCD_EXEC_TIME) * SYSCLK_FREQUENCY;
+        sending = false;
+        active = nullptr;
+    }
+
+    void SerialLCDBus::write(const BusWrite &write) {
+        while (is_sending()) {}
+        wait_ready();
+        uint8_t bytes[SERIAL_BYTES_PER_WRITE];
+        encode_serial_write(write, bytes);
+        for (uint8_t i = 0; i < SERIAL_BYTES_PER_WRITE; i ++) {
+            while (!SPI_I2S_GetFlagStatus(spi, SPI_I2S_FLAG_TXE)) {}
+            SPI_I2S_SendData(spi, bytes[i]);
+        }
+        while (SPI_I2S_GetFlagStatus(spi, SPI_I2S_FLAG_BSY)) {}
+        extended_set = next_instruction_set(write.value, write.data, extended_set);
+        ready_time = delay::cycle_count() + exec_time(write.value, write.data, extended_set) * SYSCLK_FREQUENCY;
+    }
+
+    void SerialLCDBus::write_cmd(uint8_t cmd) {
+        write({ cmd, false });
+    }
+    void SerialLCDBus::write_data(uint8_t data) {
+        write({ data, true });
+    }
+    void SerialLCDBus::write_cmd_no_wait(uint8_t cmd) {
+        write_cmd(cmd);
+    }
+} // namespace lcd
+
+// Transfer complete interrupts for the SPI1 and SPI2 TX channels
+extern "C" void DMA1_Channel3_IRQHandler() {
+    if (DMA_GetITStatus(DMA1_IT_TC3)) {
+        DMA_ClearITPendingBit(DMA1_IT_GL3);
+        if (lcd::active) {
+            lcd::active->complete();
+        }
+    }
+}
+
+extern "C" void DMA1_Channel5_IRQHandler() {
+    if (DMA_GetITStatus(DMA1_IT_TC5)) {
+        DMA_ClearITPendingBit(DMA1_IT_GL5);
+        if (lcd::active) {
+            lcd::active->complete();
+        }
+    }
+}
@@ -1,25 +1,138 @@
 #include <stdint.h>
+#include <string.h>
 #include "stm32f10x.h"
 #include "sys.h"
 #include "delay.h"
 #include "gpiopin.h"
 #include "lcd12864.h"
+#include "lcdserial.h"
+#include "lcdstatic.h"
 #include "decoder.h"
+#include "util.h"
 
+#ifdef LCD_STATIC_PINS
+// Same wiring, fixed at compile time; updates are blocking since there is no DMA engine
+typedef lcd::StaticPinMap<lcd::StaticPin<GPIOC_BASE, GPIO_Pin_10>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_11>,
+        lcd::StaticPin<GPIOC_BASE, GPIO_Pin_12>, lcd::StaticPin<GPIOB_BASE, GPIO_Pin_12>,
+        lcd::StaticPin<GPIOB_BASE, GPIO_Pin_13>, lcd::StaticPin<GPIOB_BASE, GPIO_Pin_14>,
+        lcd::StaticPin<GPIOB_BASE, GPIO_Pin_15>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_6>,
+        lcd::StaticPin<GPIOC_BASE, GPIO_Pin_7>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_8>,
+        lcd::StaticPin<GPIOC_BASE, GPIO_Pin_9>> LCDPins;
+lcd::StaticLCD12864<LCDPins> display;
+#elif defined(LCD_SERIAL)
+// Serial mode, with PSB tied low: SCLK (E) on PB13, SID (RW) on PB15 and CS (RS) on PC10
+GPIOPin CS(GPIOC, GPIO_Pin_10);
+lcd::SerialLCD12864 display(SPI2, CS);
+#else
 GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12), D7(GPIOC, GPIO_Pin_9),
         D6(GPIOC, GPIO_Pin_8), D5(GPIOC, GPIO_Pin_7), D4(GPIOC, GPIO_Pin_6), D3(GPIOB, GPIO_Pin_15),
         D2(GPIOB, GPIO_Pin_14), D1(GPIOB, GPIO_Pin_13), D0(GPIOB, GPIO_Pin_12);
 lcd::LCD12864 display(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7);
+#endif
 GPIOPin green(GPIOA, GPIO_Pin_1);
 GPIOPin yellow(GPIOA, GPIO_Pin_2);
 GPIOPin red(GPIOA, GPIO_Pin_3);
 
-constexpr uint8_t FPS = 12;
-constexpr uint16_t FRAME_INTERVAL = 1000 / FPS;
+VideoDecoder decoder(viddata, viddata_size);
 
-VideoDecoder decoder;
+// Frames are decoded ahead of time into a ring, so a frame that takes longer than a frame interval to decode
+// uses up some of the slack instead of delaying the next tick
+constexpr uint8_t FRAME_RING_SIZE = 3;
+
+struct DecodedFrame {
+    framebuf::Frame frame;
+    framebuf::DirtyMask dirty;
+    // Rows the picture moved up by, which the display does with its scroll address
+    int8_t scroll;
+};
+DecodedFrame frame_ring[FRAME_RING_SIZE];
+// Slot of the next frame to present
+uint8_t ring_head = 0;
+// Number of decoded frames waiting to be presented
+volatile uint8_t ring_count = 0;
+bool decoding_done = false;
+
+// Number of ticks that haven't been presented yet
+volatile uint16_t pending_ticks = 0;
+// Number of ticks where the next frame wasn't ready, or the previous one was still being presented
+volatile uint32_t late_ticks = 0;
+
+// Time spent in decode_ahead(), in system clock cycles, including interrupts taken meanwhile
+// The frame interval at 12 fps is 6,000,000 cycles
+uint64_t decode_cycles = 0;
+uint32_t max_decode_cycles = 0;
+uint32_t decoded_frames = 0;
+
+#ifdef RESUME_PLAYBACK
+// The last keyframe decoded is kept in the backup registers, which survive a reset (but not a power loss without
+// a backup battery), so playback carries on from there instead of starting over
+// It's stored as the frame number + 1, so the registers being cleared means starting from the beginning
+void init_resume_point() {
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR | RCC_APB1Periph_BKP, ENABLE);
+    PWR_BackupAccessCmd(ENABLE);
+}
+void save_resume_point(uint32_t frame) {
+    frame ++;
+    BKP_WriteBackupRegister(BKP_DR1, frame >> 16);
+    BKP_WriteBackupRegister(BKP_DR2, frame & 0xFFFF);
+}
+void clear_resume_point() {
+    BKP_WriteBackupRegister(BKP_DR1, 0);
+    BKP_WriteBackupRegister(BKP_DR2, 0);
+}
+// Returns false if there's nothing to resume
+bool load_resume_point(uint32_t &frame) {
+    frame = static_cast<uint32_t>(BKP_ReadBackupRegister(BKP_DR1)) << 16 | BKP_ReadBackupRegister(BKP_DR2);
+    return frame -- != 0;
+}
+#endif
+
+// Decode the next frame into the free slot after the last decoded one
+// Returns false if there are no more frames
+bool decode_ahead() {
+    const uint32_t start = delay::cycle_count();
+    DecodedFrame &last = frame_ring[(ring_head + ring_count + FRAME_RING_SIZE - 1) % FRAME_RING_SIZE];
+    DecodedFrame &next = frame_ring[(ring_head + ring_count) % FRAME_RING_SIZE];
+    // Frames are decoded as changes to the last one
+    memcpy(next.frame, last.frame, sizeof(next.frame));
+#ifdef RESUME_PLAYBACK
+    const uint32_t number = decoder.next_frame();
+#endif
+    if (!decoder.read_frame(next.frame)) {
+        return false;
+    }
+#ifdef RESUME_PLAYBACK
+    if (video::is_keyframe(decoder.get_header(), number)) {
+        save_resume_point(number);
+    }
+#endif
+    memcpy(next.dirty, decoder.changed_words(), sizeof(next.dirty));
+    next.scroll = decoder.scrolled_lines();
+    ring_count ++;
+
+    const uint32_t elapsed = delay::cycle_count() - start;
+    decode_cycles += elapsed;
+    max_decode_cycles = elapsed > max_decode_cycles ? elapsed : max_decode_cycles;
+    decoded_frames ++;
+    return true;
+}
+
+// Start sending the frame at the head of the ring to the display
+// The transfer carries on in the background while the next frames are decoded
+void present() {
+    DecodedFrame &next = frame_ring[ring_head];
+    memcpy(display.draw_buf, next.frame, sizeof(next.frame));
+    display.scroll_by(next.scroll);
+    display.start_update_drawing(next.dirty);
+    ring_head = (ring_head + 1) % FRAME_RING_SIZE;
+    NoInterrupt noi;
+    ring_count --;
+    pending_ticks --;
+}
 
 void init_frame_timer() {
+    // The framerate comes from the video's header
+    const uint16_t frame_interval = 1000 / decoder.get_header().framerate;
     // Set up timer
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
     TIM_TimeBaseInitTypeDef initStruct = {
@@ -27,7 +140,7 @@ void init_frame_timer() {
         .TIM_Prescaler = 36000 - 1,
         .TIM_CounterMode = TIM_CounterMode_Up,
         // Each tick is half a millisecond, so double the frame interval
-        .TIM_Period = FRAME_INTERVAL * 2 - 1,
+        .TIM_Period = static_cast<uint16_t>(frame_interval * 2 - 1),
         .TIM_ClockDivision = TIM_CKD_DIV1,
         .TIM_RepetitionCounter = 0,
     };
@@ -48,13 +161,13 @@ extern "C" void TIM3_IRQHandler() {
     // Check and clear interrupt pending bit
     if (TIM_GetITStatus(TIM3, TIM_IT_Update)) {
         TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
-        
-        if (decoder.read_frame(display.draw_buf)) {
-            display.update_drawing();
-        }
-        else {
-            TIM_Cmd(TIM3, DISABLE);
+
+        // Only signal the main loop; decoding and drawing happen there
+        if (ring_count == 0 || pending_ticks) {
+            late_ticks ++;
+            red = true;
         }
+        pending_ticks ++;
     }
 }
 
@@ -66,12 +179,82 @@ int main() {
     yellow.init(GPIO_Mode_Out_PP, GPIO_Speed_2MHz);
 
     display.init();
+    if (!decoder.is_supported()) {
+        // Most likely encoded with a newer version of vidproc
+        red = true;
+        display.printf("Bad video v%u", decoder.get_header().version);
+        while (true) {}
+    }
     display.start_draw();
     display.clear_drawing();
 
+#ifdef RESUME_PLAYBACK
+    init_resume_point();
+    uint32_t resume_frame;
+    if (load_resume_point(resume_frame)) {
+        // Keyframes are whole frames, so this doesn't need anything decoded before it
+        decoder.seek(resume_frame);
+    }
+#endif
+
     init_frame_timer();
+    delay::init_cycle_counter();
 
+    // Fill the ring before starting playback
+    while (ring_count < FRAME_RING_SIZE && !decoding_done) {
+        decoding_done = !decode_ahead();
+    }
+    green = true;
     TIM_Cmd(TIM3, ENABLE);
-    
+
+    while (true) {
+        // Presenting takes priority, since the tick has already happened
+        if (pending_ticks && ring_count && !display.is_updating()) {
+            present();
+        }
+        else if (ring_count < FRAME_RING_SIZE && !decoding_done) {
+            decoding_done = !decode_ahead();
+        }
+        else if (decoding_done && !ring_count) {
+            break;
+        }
+        else {
+            // Nothing to do until the next tick, or until the display is free for one that's waiting
+            // WFI still wakes up for an interrupt that is pending while they're masked,
+            // so a tick can't slip in between the check and going to sleep
+            NoInterrupt noi;
+            if (!pending_ticks || display.is_updating()) {
+                __WFI();
+            }
+        }
+    }
+    TIM_Cmd(TIM3, DISABLE);
+    while (display.is_updating()) {}
+    green = false;
+#ifdef RESUME_PLAYBACK
+    // Start from the beginning next time
+    clear_resume_point();
+#endif
+
+    // Show how many ticks were late
+    display.end_draw();
+    display.use_basic();
+    display.clear();
+    display.printf("Late ticks: %lu", static_cast<unsigned long>(late_ticks));
+    // And how many writes the drawing updates took
+    const lcd::BusStats &stats = display.get_bus_stats();
+    display.set_cursor(1, 0);
+    display.printf("Cmds: %lu", static_cast<unsigned long>(stats.commands));
+    display.set_cursor(2, 0);
+    display.printf("Data: %lu", static_cast<unsigned long>(stats.data));
+    // And the average and worst decode time per frame, in us
+    // Two 5 digit times fill the 16 character line; anything longer than a frame period shows as 99999
+    const unsigned long MAX_SHOWN_US = 99999;
+    unsigned long average_us = decoded_frames ? decode_cycles / decoded_frames / SYSCLK_FREQUENCY : 0;
+    unsigned long worst_us = max_decode_cycles / SYSCLK_FREQUENCY;
+    display.set_cursor(3, 0);
+    display.printf("Dec %lu/%lu", average_us < MAX_SHOWN_US ? average_us : MAX_SHOWN_US,
+            worst_us < MAX_SHOWN_US ? worst_us : MAX_SHOWN_US);
+
     while (true) {}
 }
@@ -0,0 +1,11 @@
+#include "serialencode.h"
+
+namespace lcd {
+
+    uint16_t encode_serial(const BusWrite *writes, uint16_t count, uint8_t *out) {
+        for (uint16_t i = 0; i < count; i ++) {
+            encode_serial_write(writes[i], out + i * SERIAL_BYTES_PER_WRITE);
+        }
+        return count * SERIAL_BYTES_PER_WRITE;
+    }
+} // namespace lcd
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "decoder.h"
+#include "encoder.h"
+
+/*
+ * Round trip checks for the codec: synthetic frames are encoded with encode_frames() in every run length coding,
+ * with and without keyframes and scrolling, and played back with the firmware's VideoDecoder. The word at a time
+ * run length encoder is checked against the bit at a time one first.
+ *
+ * Usage: codeccheck
+ * Prints every check that fails, and exits with a non-zero status if any did.
+ */
+
+namespace {
+
+    unsigned int failures = 0;
+
+    void check(bool ok, const char *what) {
+        if (!ok) {
+            std::printf("FAILED: %s\n", what);
+            failures ++;
+        }
+    }
+
+    bool same_tokens(const TokenStream &a, const TokenStream &b) {
+        return std::equal(a.items().begin(), a.items().end(), b.items().begin(), b.items().end(),
+                [](const TokenStream::Token &x, const TokenStream::Token &y) {
+                    return x.kind == y.kind && x.count == y.count && x.value == y.value;
+                });
+    }
+
+    // encode_bits() must produce exactly what encode() does one bit at a time, whatever bits are past count, and
+    // with runs carried over from one call to the next the way chunks are encoded column by column
+    void check_rle_words() {
+        std::mt19937_64 random(1);
+        bool same = true;
+        for (unsigned int trial = 0; trial < 2000 && same; trial ++) {
+            TokenStream by_bit, by_word;
+            {
+                RunLengthEncoder bit_encoder(by_bit), word_encoder(by_word);
+                for (unsigned int part = random() % 12; part; part --) {
+                    // From noise to long runs, with both all-zero and all-one words
+                    uint64_t bits = random();
+                    switch (random() % 4) {
+                        case 0: bits &= random() & random(); break;
+                        case 1: bits |= random() | random(); break;
+                        case 2: bits = bits & 1 ? ~0ull << random() % 64 : ~0ull >> random() % 64; break;
+                    }
+                    const unsigned int count = random() % 65;
+                    for (unsigned int y = 0; y < count; y ++) {
+                        bit_encoder.encode(bits >> y & 1);
+                    }
+                    word_encoder.encode_bits(bits, count);
+                }
+            }
+            same = same_tokens(by_bit, by_word);
+        }
+        check(same, "encode_bits() writes the same runs as encode() bit by bit");
+    }
+
+    constexpr unsigned int FRAME_COUNT = 100;
+
+    // Frame t of a test video that has a bit of everything the encoder looks for: a picture panning up and then
+    // down (scroll ops), a block moving on its own (some chunks changing), cuts to noise (every chunk changing),
+    // and a stretch of identical frames (no chunks changing)
+    PackedFrame test_frame(unsigned int width, unsigned int height, unsigned int t) {
+        PackedFrame frame;
+        frame.width = width;
+        frame.height = height;
+        std::mt19937 noise(t / 5);
+        for (unsigned int x = 0; x < width; x ++) {
+            for (unsigned int y = 0; y < height; y ++) {
+                bool on;
+                if (t >= 60 && t < 65) {
+                    on = noise() % 3 == 0;
+                }
+                else if (t >= 65 && t < 80) {
+                    on = (x / 9 + y / 7) % 2;
+                }
+                else if (t >= 40 && t < 60) {
+                    on = x - (t * 5) % 90 < 20 && y - (t * 2) % 30 < 10;
+                }
+                else {
+                    // Two rows a frame up until frame 40, then three rows a frame back down
+                    unsigned int row = y + 200 + (t < 40 ? t * 2 : 80 - (t - 80) * 3);
+                    on = (x / 6 + row / 4) % 5 < 2 || (x * 7 + row * 3) % 23 == 0;
+                }
+                frame.columns[x] |= static_cast<uint64_t>(on) << y;
+            }
+        }
+        return frame;
+    }
+
+    typedef std::vector<std::vector<uint8_t>> DecodedFrames;
+
+    // Pixels of the picture area of a decoded frame that differ from a frame that was encoded
+    size_t difference(framebuf::Frame decoded, const PackedFrame &frame) {
+        const unsigned int offset_x = (framebuf::WIDTH - frame.width) / 2;
+        const unsigned int offset_y = (framebuf::HEIGHT - frame.height) / 2;
+        size_t count = 0;
+        for (unsigned int x = 0; x < frame.width; x ++) {
+            for (unsigned int y = 0; y < frame.height; y ++) {
+                uint8_t byte = *framebuf::pixel_byte(decoded, offset_x + x, offset_y + y);
+                count += static_cast<bool>(byte & 0x80 >> (offset_x + x) % 8) != frame.get(x, y);
+            }
+        }
+        return count;
+    }
+
+    // Encode the test video with format's codec parameters, play it back, and return the decoded frames
+    DecodedFrames round_trip(const video::Header &format, unsigned int width, unsigned int height) {
+        unsigned int next = 0;
+        std::stringstream out;
+        StageTimer timer;
+        EncodeStats stats;
+        // The encoder reports its progress on std::cout
+        std::streambuf *console = std::cout.rdbuf(nullptr);
+        bool encoded = encode_frames([&](PackedFrame &frame) {
+            if (next == FRAME_COUNT) {
+                return false;
+            }
+            frame = test_frame(width, height, next ++);
+            return true;
+        }, out, format, timer, stats, 2);
+        std::cout.rdbuf(console);
+        check(encoded && stats.frame_count == FRAME_COUNT, "Every frame is encoded");
+        // With a keyframe every frame there is nothing to scroll
+        check(stats.scrolled_frames != 0 || format.keyframe_interval == 1, "The panning frames are encoded as scrolls");
+
+        // The decoder reads whole words, so keep the data word aligned and padded
+        const std::string bytes = out.str();
+        std::vector<uint32_t> words(bytes.size() / 4 + 1);
+        memcpy(words.data(), bytes.data(), bytes.size());
+        VideoDecoder decoder(reinterpret_cast<const uint8_t *>(words.data()), bytes.size());
+        check(decoder.is_supported() && decoder.get_header().frame_count == FRAME_COUNT,
+                "The header has the codec and the frame count");
+
+        DecodedFrames decoded;
+        framebuf::Frame frame = {};
+        size_t error = 0;
+        bool keyframes_exact = true;
+        while (decoded.size() < FRAME_COUNT && decoder.read_frame(frame)) {
+            const unsigned int t = decoded.size();
+            size_t frame_error = difference(frame, test_frame(width, height, t));
+            keyframes_exact &= !video::is_keyframe(decoder.get_header(), t) || frame_error == 0;
+            error += frame_error;
+            decoded.emplace_back(&frame[0][0], &frame[0][0] + sizeof(frame));
+        }
+        check(decoded.size() == FRAME_COUNT && !decoder.read_frame(frame), "Every frame decodes, and no more");
+        check(keyframes_exact, "Keyframes decode to exactly the frame that was encoded");
+        // The encoder keeps track of the picture the decoder will have, and counts how far off it is
+        check(error == stats.frame_error, "Decoded frames are what the encoder expected them to be");
+
+        // Going to any frame through the keyframe index gets the same picture as playing up to it
+        VideoDecoder seeker(reinterpret_cast<const uint8_t *>(words.data()), bytes.size());
+        bool seeks_match = true;
+        for (uint32_t target = 0; target < decoded.size() && seeks_match; target ++) {
+            seeks_match = seeker.seek(target) && seeker.next_frame() <= target;
+            while (seeks_match && seeker.next_frame() <= target) {
+                seeks_match = seeker.read_frame(frame);
+            }
+            seeks_match = seeks_match && !memcmp(frame, decoded[target].data(), sizeof(frame));
+        }
+        check(seeks_match, "Seeking to every frame matches playing up to it");
+        return decoded;
+    }
+
+    void check_round_trips() {
+        struct Layout {
+            unsigned int width, height;
+            uint8_t chunk_count_x, chunk_count_y, group_size;
+        };
+        // The firmware's defaults, and a smaller picture with chunks that don't divide it evenly
+        static const Layout LAYOUTS[] = { { 128, 64, 8, 8, 3 }, { 100, 48, 5, 3, 1 } };
+        static const uint16_t KEYFRAME_INTERVALS[] = { 0, 1, 25 };
+        for (const Layout &layout : LAYOUTS) {
+            for (uint16_t interval : KEYFRAME_INTERVALS) {
+                video::Header format = video::DEFAULT_HEADER;
+                format.chunk_count_x = layout.chunk_count_x;
+                format.chunk_count_y = layout.chunk_count_y;
+                format.group_size = layout.group_size;
+                format.keyframe_interval = interval;
+
+                format.flags = 0;
+                DecodedFrames grouped = round_trip(format, layout.width, layout.height);
+                format.flags = video::HUFFMAN_RUNS;
+                DecodedFrames huffman = round_trip(format, layout.width, layout.height);
+                format.flags = video::RANS_CODED;
+                DecodedFrames rans = round_trip(format, layout.width, layout.height);
+                // Only the run length coding differs, so the pictures must not
+                check(huffman == grouped, "Huffman coded runs decode to the same frames as grouped runs");
+                check(rans == grouped, "rANS coding decodes to the same frames as grouped runs");
+            }
+        }
+    }
+} // namespace
+
+int main() {
+    check_rle_words();
+    check_round_trips();
+
+    if (failures) {
+        std::printf("%u checks failed\n", failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}
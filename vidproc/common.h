@@ -1,14 +1,19 @@
 #pragma once
 
+#include "videoformat.h"
+
 constexpr inline unsigned int SCREEN_WIDTH = 128;
 constexpr inline unsigned int SCREEN_HEIGHT = 64;
 
-constexpr inline unsigned int FRAMERATE = 12;
-constexpr inline unsigned int FRAME_INTERVAL = 1000 / FRAMERATE;
-
-constexpr inline unsigned int CHUNK_COUNT_X = 8;
-constexpr inline unsigned int CHUNK_COUNT_Y = 8;
-constexpr inline unsigned int CHUNK_COUNT = CHUNK_COUNT_Y * CHUNK_COUNT_X;
-
+// The framerate, chunk grid and RLE group size are stored in the video header (see videoformat.h)
+// The encoder uses the ones in video::DEFAULT_HEADER unless they're overridden on the command line
 constexpr inline unsigned int FRAME_DIFF_PCT = 8;
 constexpr inline unsigned int FRAME_CONST_FACTOR = 5;
+
+// Default time between keyframes; more often makes seeking faster, but every keyframe is a whole frame
+constexpr inline unsigned int KEYFRAME_SECONDS = 10;
+
+// Largest scroll the encoder looks for, in rows
+constexpr inline unsigned int MAX_SCROLL = 24;
+// A scroll is only used if it leaves at most this percentage of the pixels different
+constexpr inline unsigned int SCROLL_GAIN_PCT = 50;
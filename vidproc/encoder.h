@@ -0,0 +1,999 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "packedframe.h"
+#include "pipeline.h"
+
+/*
+ * The encoder: everything between packed frames and the bytes of a video file (see videoformat.h).
+ *
+ * None of it depends on OpenCV, so it can be built and checked on its own (see codeccheck.cpp).
+ */
+
+// Util class for writing bits to a stream, MSB first.
+//
+// Bits are collected in a 64-bit register, which is appended to an in-memory buffer whenever it fills up.
+// The buffer only goes to the stream once it reaches BUFFER_SIZE (or when the BitStream is destroyed), so the
+// stream sees a few large writes instead of one put() per byte.
+class BitStream {
+    std::ostream &stream;
+    std::vector<char> buffer;
+    // The pending bits are the lowest count bits of acc; the oldest one is the most significant
+    uint64_t acc;
+    unsigned int count;
+    bool finished = false;
+    // Bytes already sent to the stream
+    size_t flushed = 0;
+
+    void put_word(uint64_t word) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            buffer.push_back(static_cast<char>(word >> shift));
+        }
+        if (buffer.size() >= BUFFER_SIZE) {
+            flush();
+        }
+    }
+
+public:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    BitStream(std::ostream &stream) : stream(stream), acc(0), count(0) {
+        buffer.reserve(BUFFER_SIZE + 8);
+    }
+
+    ~BitStream() {
+        finish();
+    }
+
+    // Write out whole bytes, then the last partial byte padded with zeros, and send everything to the stream
+    // Nothing more may be written after this
+    void finish() {
+        if (finished) {
+            return;
+        }
+        align();
+        for (; count >= 8; count -= 8) {
+            buffer.push_back(static_cast<char>(acc >> (count - 8)));
+        }
+        flush();
+        finished = true;
+    }
+
+    // Write the lowest n bits of value, most significant first (n <= 64)
+    void write_bits(uint64_t value, unsigned int n) {
+        if (n < 64) {
+            value &= (1ull << n) - 1;
+        }
+        unsigned int space = 64 - count;
+        if (n < space) {
+            acc = (acc << n) | value;
+            count += n;
+            return;
+        }
+        // Fill up the register, then start over with whatever doesn't fit
+        unsigned int rest = n - space;
+        put_word(count == 0 ? value >> rest : (acc << space) | (value >> rest));
+        acc = rest ? value & ((1ull << rest) - 1) : 0;
+        count = rest;
+    }
+
+    void write(bool bit) {
+        write_bits(bit, 1);
+    }
+
+    // Pad with zeros up to the next byte boundary
+    void align() {
+        if (count % 8) {
+            write_bits(0, 8 - count % 8);
+        }
+    }
+
+    // Number of whole bytes written so far
+    size_t position() const {
+        return flushed + buffer.size() + count / 8;
+    }
+
+    // Send everything in the buffer to the stream
+    // Bits still in the register are kept until they make up a whole word
+    void flush() {
+        stream.write(buffer.data(), buffer.size());
+        flushed += buffer.size();
+        buffer.clear();
+    }
+
+    BitStream& operator<<(bool bit) {
+        write(bit);
+        return *this;
+    }
+};
+
+// Number of runs with each symbol of the Huffman code (see video::run_symbol())
+typedef std::array<size_t, video::RUN_SYMBOLS> RunHistogram;
+
+// How run lengths are written to the bitstream
+class RunCode {
+public:
+    virtual ~RunCode() = default;
+
+    // Write a run length (1 <= run <= video::MAX_REPEAT)
+    virtual void write(BitStream &stream, unsigned int run) const = 0;
+};
+
+// The original run length code: a group count in unary, then that many groups of group_size bits
+class GroupedRunCode : public RunCode {
+    const unsigned int group_size;
+    video::RepeatOffsets offsets;
+
+public:
+    GroupedRunCode(unsigned int group_size) : group_size(group_size) {
+        video::repeat_offsets(group_size, offsets);
+    }
+
+    void write(BitStream &stream, unsigned int run) const override {
+        // A repeat of zero is not possible, so everything is offset by 1
+        unsigned int repeat = run - 1;
+        // Calculate the number of bits needed
+        unsigned int groups;
+        // Keep increasing the group count
+        // while the repeat count is still greater than the limit of the NEXT group count
+        for (groups = 1; repeat >= offsets[groups]; groups ++);
+        // Subtract the correct offset
+        repeat -= offsets[groups - 1];
+        // Write the group count in unary (groups - 1 ones and a zero), then the value
+        stream.write_bits(((1u << (groups - 1)) - 1) << 1, groups);
+        stream.write_bits(repeat, groups * group_size);
+    }
+};
+
+// Canonical Huffman code for run lengths, with the code lengths from a video header (see HUFFMAN_RUNS)
+class HuffmanRunCode : public RunCode {
+    uint8_t lengths[video::RUN_SYMBOLS];
+    uint16_t codes[video::RUN_SYMBOLS];
+
+public:
+    HuffmanRunCode(const video::Header &format) {
+        std::copy(std::begin(format.run_code_lengths), std::end(format.run_code_lengths), lengths);
+        video::run_codes(format, codes);
+    }
+
+    void write(BitStream &stream, unsigned int run) const override {
+        const uint8_t symbol = video::run_symbol(run);
+        stream.write_bits(codes[symbol], lengths[symbol]);
+        stream.write_bits(run - video::run_base(symbol), video::run_extra_bits(symbol));
+    }
+
+    // Fill in the code lengths of the Huffman code that takes the fewest bits for runs with these symbol counts
+    // Codes can't be longer than MAX_RUN_CODE_LENGTH, so if any would be, the counts are flattened until none are
+    static void make_code(const RunHistogram &histogram, video::Header &format) {
+        RunHistogram counts = histogram;
+        while (true) {
+            huffman_lengths(counts, format.run_code_lengths);
+            if (*std::max_element(std::begin(format.run_code_lengths), std::end(format.run_code_lengths))
+                    <= video::MAX_RUN_CODE_LENGTH) {
+                return;
+            }
+            // Halving keeps the order of the counts, but brings the rare ones closer to the rest
+            for (size_t &count : counts) {
+                count = (count + 1) / 2;
+            }
+        }
+    }
+
+private:
+    // Plain Huffman code lengths, with no limit
+    static void huffman_lengths(const RunHistogram &counts, uint8_t (&lengths)[video::RUN_SYMBOLS]) {
+        // Leaves are the symbols, then every merge adds a node; the queue has the smallest count first
+        std::vector<size_t> parent(video::RUN_SYMBOLS * 2, 0);
+        std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>,
+                std::greater<std::pair<size_t, size_t>>> queue;
+        for (size_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+            if (counts[symbol]) {
+                queue.emplace(counts[symbol], symbol);
+            }
+        }
+        std::fill(std::begin(lengths), std::end(lengths), 0);
+        // A code needs at least two symbols to have a length; one on its own gets a 1-bit code
+        if (queue.size() < 2) {
+            lengths[queue.empty() ? 0 : queue.top().second] = 1;
+            return;
+        }
+        size_t next = video::RUN_SYMBOLS;
+        while (queue.size() > 1) {
+            auto a = queue.top();
+            queue.pop();
+            auto b = queue.top();
+            queue.pop();
+            parent[a.second] = parent[b.second] = next;
+            queue.emplace(a.first + b.first, next ++);
+        }
+        // The root is the last node; a symbol's code length is how far it is from it
+        const size_t root = next - 1;
+        for (size_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+            if (!counts[symbol]) {
+                continue;
+            }
+            uint8_t length = 0;
+            for (size_t node = symbol; node != root; node = parent[node]) {
+                length ++;
+            }
+            lengths[symbol] = length;
+        }
+    }
+};
+
+/*
+ * Encoded frames, with the run lengths kept as numbers instead of bits.
+ *
+ * Which bits a run length turns into can depend on every run in the video (see HuffmanRunCode), so frames are
+ * encoded into one of these first, and written to a BitStream once the run length code is known. The parts of
+ * the frame header are kept apart too, since rANS codes them differently (see RansCoder).
+ */
+class TokenStream {
+public:
+    struct Token {
+        enum Kind : uint8_t {
+            // The lowest count bits of value
+            BITS,
+            // A run length
+            RUN,
+            // A chunk mask of count chunks
+            CHUNK_MASK,
+            // Whether the frame is scrolled, as 1 bit
+            SCROLL_FLAG,
+        };
+        uint64_t value;
+        uint8_t count;
+        Kind kind;
+    };
+
+private:
+    std::vector<Token> tokens;
+
+public:
+    // Write the lowest n bits of value, most significant first (n <= 64)
+    void write_bits(uint64_t value, unsigned int n) {
+        if (n) {
+            tokens.push_back({value, static_cast<uint8_t>(n), Token::BITS});
+        }
+    }
+
+    void write(bool bit) {
+        write_bits(bit, 1);
+    }
+
+    void write_run(unsigned int run) {
+        tokens.push_back({run, 0, Token::RUN});
+    }
+
+    void write_chunk_mask(uint64_t mask, unsigned int chunks) {
+        tokens.push_back({mask, static_cast<uint8_t>(chunks), Token::CHUNK_MASK});
+    }
+
+    void write_scroll_flag(bool scrolled) {
+        tokens.push_back({scrolled, 1, Token::SCROLL_FLAG});
+    }
+
+    const std::vector<Token>& items() const {
+        return tokens;
+    }
+
+    RunHistogram run_histogram() const {
+        RunHistogram histogram{};
+        for (const Token &token : tokens) {
+            if (token.kind == Token::RUN) {
+                histogram[video::run_symbol(token.value)] ++;
+            }
+        }
+        return histogram;
+    }
+
+    // Write everything out, with the run lengths in code
+    void write_to(BitStream &stream, const RunCode &code) const {
+        for (const Token &token : tokens) {
+            if (token.kind == Token::RUN) {
+                code.write(stream, token.value);
+            }
+            else {
+                stream.write_bits(token.value, token.count);
+            }
+        }
+    }
+
+    TokenStream& operator<<(bool bit) {
+        write(bit);
+        return *this;
+    }
+};
+
+/*
+ * Static rANS models for a whole video, and the coder that uses them, with RANS_CODED (see videoformat.h).
+ *
+ * rANS decodes in the opposite order it encodes in, so a segment's values are all modelled first, and then coded
+ * from the last one back. The decoder then reads the stream front to back, with the bytes in the order it wants.
+ */
+class RansCoder {
+public:
+    // How often everything the models cover comes up
+    struct Counts {
+        RunHistogram runs{};
+        size_t bits[video::RANS_BIT_MODELS][2]{};
+    };
+
+private:
+    uint16_t run_freqs[video::RUN_SYMBOLS];
+    uint16_t run_starts[video::RUN_SYMBOLS];
+    uint16_t bit_freqs[video::RANS_BIT_MODELS];
+
+    // A range of slots, in the order the decoder reads them
+    struct Symbol {
+        uint16_t start;
+        uint16_t freq;
+    };
+
+    // Go through the values in tokens the way the decoder reads them, calling visit.run(symbol),
+    // visit.bit(model, bit) and visit.raw(value, count) for each
+    template <typename Visitor>
+    static void walk(const TokenStream &tokens, Visitor &visit) {
+        // Every stream starts at a keyframe, which has every chunk
+        uint64_t last_mask = ~0ull;
+        for (const TokenStream::Token &token : tokens.items()) {
+            switch (token.kind) {
+            case TokenStream::Token::BITS:
+                // The decoder reads raw bits a field at a time, and no field is wider than a model's slots
+                assert(token.count <= video::RANS_SCALE_BITS);
+                visit.raw(token.value, token.count);
+                break;
+            case TokenStream::Token::RUN: {
+                const uint8_t symbol = video::run_symbol(token.value);
+                visit.run(symbol);
+                visit.raw(token.value - video::run_base(symbol), video::run_extra_bits(symbol));
+                break;
+            }
+            case TokenStream::Token::CHUNK_MASK:
+                for (unsigned int chunk = 0; chunk < token.count; chunk ++) {
+                    const bool before = chunk && (token.value >> (chunk - 1) & 1);
+                    visit.bit(video::mask_bit_model(before, last_mask >> chunk & 1), token.value >> chunk & 1);
+                }
+                last_mask = token.value;
+                break;
+            case TokenStream::Token::SCROLL_FLAG:
+                visit.bit(video::RANS_SCROLL_MODEL, token.value);
+                break;
+            }
+        }
+    }
+
+public:
+    RansCoder(const video::Header &format) {
+        uint16_t start = 0;
+        for (uint8_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+            run_freqs[symbol] = format.rans_run_freqs[symbol];
+            run_starts[symbol] = start;
+            start += run_freqs[symbol];
+        }
+        std::copy(std::begin(format.rans_bit_freqs), std::end(format.rans_bit_freqs), bit_freqs);
+    }
+
+    // Add up how often everything in tokens comes up
+    static void count(const TokenStream &tokens, Counts &counts) {
+        struct {
+            Counts &counts;
+            void run(uint8_t symbol) {
+                counts.runs[symbol] ++;
+            }
+            void bit(uint8_t model, bool bit) {
+                counts.bits[model][bit] ++;
+            }
+            void raw(uint16_t, uint8_t) {}
+        } visit{counts};
+        walk(tokens, visit);
+    }
+
+    // Fill in the models in the header from the counts
+    // Everything that comes up gets at least one slot, so it can be coded
+    static void make_tables(const Counts &counts, video::Header &format) {
+        size_t total = 0;
+        for (size_t count : counts.runs) {
+            total += count;
+        }
+        int remaining = video::RANS_SCALE;
+        for (uint8_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+            const size_t count = counts.runs[symbol];
+            format.rans_run_freqs[symbol] = !count ? 0
+                    : std::max<size_t>(1, count * video::RANS_SCALE / total);
+            remaining -= format.rans_run_freqs[symbol];
+        }
+        // Rounding leaves a few slots over (or under, from the ones bumped up to 1); they go to or come from the
+        // most common symbol, where they make the least difference
+        // With no runs at all, that's just the first symbol, and it gets every slot
+        uint16_t *const freqs = format.rans_run_freqs;
+        for (; remaining > 0; remaining --) {
+            (*std::max_element(freqs, freqs + video::RUN_SYMBOLS)) ++;
+        }
+        for (; remaining < 0; remaining ++) {
+            (*std::max_element(freqs, freqs + video::RUN_SYMBOLS)) --;
+        }
+        for (uint8_t model = 0; model < video::RANS_BIT_MODELS; model ++) {
+            const size_t zeros = counts.bits[model][0];
+            const size_t ones = counts.bits[model][1];
+            const size_t freq = zeros + ones ? (zeros * video::RANS_SCALE + (zeros + ones) / 2) / (zeros + ones)
+                    : video::RANS_SCALE / 2;
+            format.rans_bit_freqs[model] = std::min<size_t>(std::max<size_t>(freq, 1), video::RANS_SCALE - 1);
+        }
+    }
+
+    // Code the tokens of a segment into an rANS stream
+    std::string encode(const TokenStream &tokens) const {
+        std::vector<Symbol> symbols;
+        struct {
+            const RansCoder &coder;
+            std::vector<Symbol> &symbols;
+            void run(uint8_t symbol) {
+                symbols.push_back({coder.run_starts[symbol], coder.run_freqs[symbol]});
+            }
+            void bit(uint8_t model, bool bit) {
+                const uint16_t zero = coder.bit_freqs[model];
+                symbols.push_back(bit ? Symbol{zero, static_cast<uint16_t>(video::RANS_SCALE - zero)}
+                        : Symbol{0, zero});
+            }
+            void raw(uint16_t value, uint8_t count) {
+                // Every value gets the same number of slots
+                const uint8_t shift = video::RANS_SCALE_BITS - count;
+                symbols.push_back({static_cast<uint16_t>(value << shift), static_cast<uint16_t>(1 << shift)});
+            }
+        } visit{*this, symbols};
+        walk(tokens, visit);
+
+        // The bytes come out back to front
+        std::string out;
+        uint32_t state = video::RANS_LOWER_BOUND;
+        for (auto symbol = symbols.rbegin(); symbol != symbols.rend(); symbol ++) {
+            // Make room for the symbol, so the state is still below the upper bound after adding it
+            const uint32_t limit = ((video::RANS_LOWER_BOUND >> video::RANS_SCALE_BITS) << 8) * symbol->freq;
+            while (state >= limit) {
+                out.push_back(static_cast<char>(state));
+                state >>= 8;
+            }
+            state = ((state / symbol->freq) << video::RANS_SCALE_BITS) + state % symbol->freq + symbol->start;
+        }
+        // The final state goes first, most significant byte first
+        for (int i = 0; i < 4; i ++) {
+            out.push_back(static_cast<char>(state));
+            state >>= 8;
+        }
+        std::reverse(out.begin(), out.end());
+        return out;
+    }
+};
+
+// Util class for run-length encoding bits and writing to a stream.
+class RunLengthEncoder {
+    TokenStream &stream;
+    bool val;
+    int repeat;
+
+private:
+    void flush() {
+        if (repeat < 1) {
+            return;
+        }
+
+		//std::cout << "encoding " << repeat << "\n";
+        stream.write_run(repeat);
+
+        // Flip current value and reset counter
+        repeat = 0;
+        val = !val;
+    }
+
+public:
+    RunLengthEncoder(TokenStream &stream) : stream(stream), val(false), repeat(-1) {}
+
+    ~RunLengthEncoder() {
+        flush();
+		//std::cout << "rle over\n";
+    }
+
+    void encode(bool bit) {
+        // Starting value not set -- write it
+        if (repeat == -1) {
+            stream << bit;
+            val = bit;
+            repeat = 1;
+        }
+        else {
+            if (bit != val) {
+                flush();
+            }
+            repeat ++;
+        }
+    }
+
+    // Encode the lowest count bits of a word, LSB first
+    // Produces the same output as calling encode() for every bit, but handles a whole run at a time
+    void encode_bits(uint64_t bits, unsigned int count) {
+        if (count == 0) {
+            return;
+        }
+        // Starting value not set -- write it
+        if (repeat == -1) {
+            val = bits & 1;
+            stream << val;
+            repeat = 0;
+        }
+        while (true) {
+            // The current run ends at the first bit that differs from the current value
+            uint64_t differ = (val ? ~bits : bits) & bit_range(0, count);
+            unsigned int run = differ ? count_trailing_zeros(differ) : count;
+            repeat += run;
+            if (run == count) {
+                return;
+            }
+            flush();
+            bits >>= run;
+            count -= run;
+        }
+    }
+
+    RunLengthEncoder& operator<<(bool bit) {
+        encode(bit);
+        return *this;
+    }
+};
+
+/*
+ * Threads for the CPU heavy stages: the preprocessing workers and the segment encoders share them.
+ *
+ * The capture thread gets a core of its own, since it decodes the source video. The main thread and the writer
+ * mostly wait on the queues, so they don't get one.
+ */
+inline size_t worker_budget() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 2 ? cores - 1 : 1;
+}
+
+/*
+ * Find the vertical scroll that makes previous look most like current.
+ *
+ * Returns the number of rows to move previous up by (negative for down), or 0 if no scroll is much better than
+ * leaving it where it is.
+ */
+inline int find_scroll(const PackedFrame &previous, const PackedFrame &current) {
+    const size_t unscrolled = previous.difference(current);
+    int best = 0;
+    size_t best_difference = unscrolled;
+    const int max_scroll = std::min(MAX_SCROLL, current.height - 1);
+    for (int lines = -max_scroll; lines <= max_scroll; lines ++) {
+        if (!lines) {
+            continue;
+        }
+        PackedFrame scrolled = previous;
+        scrolled.scroll(lines);
+        size_t difference = scrolled.difference(current);
+        if (difference < best_difference) {
+            best = lines;
+            best_difference = difference;
+        }
+    }
+    return best_difference * 100 <= unscrolled * SCROLL_GAIN_PCT ? best : 0;
+}
+
+/*
+ * A run of frames from one keyframe up to the next, and what they encode to.
+ *
+ * Nothing carries over from one segment to the next, so segments can be encoded in any order, on any thread, and
+ * the outputs joined end to end. Every segment's output starts on a byte boundary, like the keyframe at its start.
+ */
+struct Segment {
+    // The first one is the keyframe
+    std::vector<PackedFrame> frames;
+    // The encoded frames, before and after the run lengths are written out
+    TokenStream tokens;
+    // Padded to a whole byte
+    std::string data;
+    // Stats; the frames are dropped once they're encoded, so their count is kept here
+    size_t frame_count = 0;
+    size_t frame_error = 0;
+    size_t scrolled_frames = 0;
+};
+
+/*
+ * Encode the frames in a segment into its tokens.
+ *
+ * This method divides the frame into regions. The chunk grid and RLE group size are taken from format.
+ */
+inline void encode_segment(Segment &segment, const video::Header &format, StageTimer &encode_timer) {
+    const unsigned int fwidth = format.width;
+    const unsigned int fheight = format.height;
+    const unsigned int CHUNK_COUNT_X = format.chunk_count_x;
+    const unsigned int CHUNK_COUNT_Y = format.chunk_count_y;
+    const unsigned int CHUNK_COUNT = CHUNK_COUNT_X * CHUNK_COUNT_Y;
+    // Find the chunk size
+    // Divide and round up; the right & bottom chunks are a little smaller
+    // Makes the code a little cleaner later on
+    const unsigned int CHUNK_WIDTH = (fwidth - 1) / CHUNK_COUNT_X + 1;
+    const unsigned int CHUNK_HEIGHT = (fheight - 1) / CHUNK_COUNT_Y + 1;
+
+#define CHUNK_FOR(cx, cy) (cx * CHUNK_COUNT_Y + cy)
+
+    TokenStream &out_bits = segment.tokens;
+    PackedFrame previous;
+	// Keep track of how long we've "delayed" frame changes by
+	size_t accumulated_chunk_error[video::MAX_CHUNK_COUNT_X * video::MAX_CHUNK_COUNT_Y]{};
+
+    for (size_t count = 0; count < segment.frames.size(); count ++) {
+        const PackedFrame &processed = segment.frames[count];
+        StageTimer::Scope encode_scope(encode_timer);
+
+        // The first frame is a keyframe: run-length encode the whole frame on its own
+        if (count == 0) {
+            RunLengthEncoder encoder(out_bits);
+            for (unsigned int x = 0; x < fwidth; x ++) {
+#ifdef PER_BIT_RLE
+                for (unsigned int y = 0; y < fheight; y ++) {
+                    encoder << processed.get(x, y);
+                }
+#else
+                encoder.encode_bits(processed.columns[x], fheight);
+#endif
+            }
+            previous = processed;
+            continue;
+        }
+
+        // Scroll the previous frame first if the picture moved vertically
+        // The chunks are then compared against the scrolled frame, the same as the decoder will have it
+        const int scroll = find_scroll(previous, processed);
+        if (scroll) {
+            previous.scroll(scroll);
+            segment.scrolled_frames ++;
+        }
+
+        // Find the chunks that changed
+        uint64_t mask = 1;
+        uint64_t changed_chunks = 0;
+		size_t   overall_frame_err = 0; // for stats
+        for (unsigned int cx = 0; cx < CHUNK_COUNT_X; cx ++) {
+            for (unsigned int cy = 0; cy < CHUNK_COUNT_Y; cy ++) {
+				unsigned int cxend = std::min((cx + 1) * CHUNK_WIDTH, fwidth);
+				unsigned int cyend = std::min((cy + 1) * CHUNK_HEIGHT, fheight);
+				// Rows of this chunk within a column word
+				uint64_t rows = bit_range(cy * CHUNK_HEIGHT, cyend);
+				uint64_t check = processed.get(cx * CHUNK_WIDTH, cy * CHUNK_HEIGHT) ? rows : 0;
+				bool allsame = true;
+				size_t chunk_error = 0;
+                for (unsigned int x = cx * CHUNK_WIDTH; x < cxend; x ++) {
+					chunk_error += popcount((processed.columns[x] ^ previous.columns[x]) & rows);
+					allsame &= (processed.columns[x] & rows) == check;
+                }
+				accumulated_chunk_error[CHUNK_FOR(cx, cy)] += chunk_error;
+				if (allsame && accumulated_chunk_error[CHUNK_FOR(cx, cy)]) accumulated_chunk_error[CHUNK_FOR(cx, cy)] += FRAME_CONST_FACTOR;
+				if (accumulated_chunk_error[CHUNK_FOR(cx, cy)] > (CHUNK_WIDTH * CHUNK_HEIGHT * FRAME_DIFF_PCT) / 100) {
+					accumulated_chunk_error[CHUNK_FOR(cx, cy)] = 0;
+					changed_chunks |= mask;
+					// update previous
+					previous.copy_region(processed, cx * CHUNK_WIDTH, cxend, cy * CHUNK_HEIGHT, cyend);
+				}
+				else {
+					overall_frame_err += chunk_error;
+				}
+                mask <<= 1;
+            }
+        }
+
+		segment.frame_error += overall_frame_err;
+		//std::cout << "using mask " << changed_chunks << std::endl;
+
+        // Write frame header, then the scroll op
+        out_bits.write_chunk_mask(changed_chunks, CHUNK_COUNT);
+        out_bits.write_scroll_flag(scroll != 0);
+        if (scroll) {
+            // 7-bit two's complement
+            out_bits.write_bits(scroll & 0x7F, 7);
+        }
+
+		// If unchanged, don't encode frame
+		if (changed_chunks) {
+			// Encode the frame, skipping unchanged chunks
+			RunLengthEncoder encoder(out_bits);
+			for (unsigned int x = 0; x < fwidth; x ++) {
+#ifdef PER_BIT_RLE
+				// Old per-pixel path; kept around for benchmarking against encode_bits()
+				for (unsigned int y = 0; y < fheight; y ++) {
+					// Entered new chunk
+					if (y % CHUNK_HEIGHT == 0) {
+						unsigned int cx = std::min(x / CHUNK_WIDTH, CHUNK_COUNT_X - 1);
+						unsigned int cy = std::min(y / CHUNK_HEIGHT, CHUNK_COUNT_Y - 1);
+						// Check that the chunk is changed
+						if (!(changed_chunks & (1ull << (CHUNK_FOR(cx, cy))))) {
+							// Skip chunk if unchanged
+							// Offset 1 for the loop
+							y += CHUNK_HEIGHT - 1;
+							continue;
+						}
+					}
+					encoder << processed.get(x, y);
+				}
+#else
+				// Encode the part of the column in every changed chunk, skipping the rest
+				unsigned int cx = x / CHUNK_WIDTH;
+				for (unsigned int cy = 0; cy < CHUNK_COUNT_Y && cy * CHUNK_HEIGHT < fheight; cy ++) {
+					if (changed_chunks & (1ull << (CHUNK_FOR(cx, cy)))) {
+						unsigned int ystart = cy * CHUNK_HEIGHT;
+						unsigned int yend = std::min(ystart + CHUNK_HEIGHT, fheight);
+						encoder.encode_bits(processed.columns[x] >> ystart, yend - ystart);
+					}
+				}
+#endif
+			}
+		}
+    }
+#undef CHUNK_FOR
+
+    segment.frame_count = segment.frames.size();
+    // Free the frames now, since encoded segments may wait a while to be written
+    std::vector<PackedFrame>().swap(segment.frames);
+}
+
+/*
+ * Write out a segment's tokens into its data, with the run lengths in code.
+ */
+inline void write_segment(Segment &segment, const RunCode &code) {
+    std::ostringstream out;
+    {
+        BitStream out_bits(out);
+        segment.tokens.write_to(out_bits, code);
+    }
+    segment.data = out.str();
+    segment.tokens = TokenStream();
+}
+
+/*
+ * Encodes segments on a pool of worker threads and hands them back in their original order.
+ *
+ * Like the FramePipeline, all the queues are bounded, so only a few segments are held in memory at a time.
+ * If the run length code is known up front, the segments are written out too; otherwise they're left as tokens.
+ */
+class SegmentEncoder {
+    const video::Header format;
+    const RunCode *const code;
+
+    BoundedQueue<std::pair<size_t, Segment>> pending;
+    ReorderQueue<Segment> encoded;
+    size_t count = 0;
+
+    StageTimer &encode_timer;
+    std::vector<std::thread> workers;
+
+    void encode() {
+        std::pair<size_t, Segment> item;
+        while (pending.pop(item)) {
+            encode_segment(item.second, format, encode_timer);
+            if (code) {
+                write_segment(item.second, *code);
+            }
+            if (!encoded.push(item.first, std::move(item.second))) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Half of the worker budget; the preprocessing workers get the rest
+    static size_t default_worker_count() {
+        return std::max<size_t>(worker_budget() / 2, 1);
+    }
+
+    // The workers' encoding time goes to encode_timer
+    SegmentEncoder(const video::Header &format, const RunCode *code, StageTimer &encode_timer,
+            size_t worker_count = default_worker_count())
+            : format(format), code(code), pending(worker_count), encoded(worker_count * 2),
+            encode_timer(encode_timer) {
+        for (size_t i = 0; i < worker_count; i ++) {
+            workers.emplace_back(&SegmentEncoder::encode, this);
+        }
+    }
+
+    ~SegmentEncoder() {
+        pending.close();
+        encoded.close();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Queue the next segment, blocking while the workers are behind
+    void push(Segment segment) {
+        pending.push(std::make_pair(count ++, std::move(segment)));
+    }
+
+    // Call once every segment has been pushed
+    void finish() {
+        encoded.finish(count);
+        pending.close();
+    }
+
+    // Get the next encoded segment, in order
+    // Returns false once there are no segments left
+    bool next(Segment &segment) {
+        return encoded.pop(segment);
+    }
+
+    size_t worker_count() const {
+        return workers.size();
+    }
+};
+
+// Totals from encode_frames(), for the stats
+struct EncodeStats {
+    unsigned int width = 0;
+    unsigned int height = 0;
+    size_t frame_count = 0;
+    size_t frame_error = 0;
+    size_t scrolled_frames = 0;
+    size_t keyframes = 0;
+    // Bytes of video data, not counting the header and the index
+    size_t data_size = 0;
+};
+
+/*
+ * Compress & encode the frames from next_frame and write the video to the stream.
+ *
+ * The video is split into segments at the keyframes (see Segment), which are encoded in parallel and written out
+ * in order. The framerate, chunk grid, RLE group size and keyframe interval are taken from format; the rest of
+ * the header is filled in here. Every frame must have the same size.
+ * Returns false (with a message on std::cerr) if the video can't be encoded.
+ */
+inline bool encode_frames(const std::function<bool(PackedFrame &)> &next_frame, std::ostream &out,
+        video::Header format, StageTimer &encode_timer, EncodeStats &stats,
+        size_t encode_workers = SegmentEncoder::default_worker_count()) {
+    PackedFrame processed;
+    // First frame is special
+    if (!next_frame(processed)) {
+        std::cerr << "Cannot encode video: Nothing to read\n";
+        return false;
+    }
+    // Write the header
+    // The frame count and index offset aren't known yet, so they're filled in at the end if the stream can seek
+    // So are the run length code and the rANS tables, which is why those need a stream that can seek
+    const uint8_t codec_flags = format.flags & (video::HUFFMAN_RUNS | video::RANS_CODED);
+    format.version = video::VERSION;
+    format.flags = video::SCROLL_OPS;
+    format.width = processed.width;
+    format.height = processed.height;
+    format.frame_count = 0;
+    format.index_offset = 0;
+    if (!video::is_supported(format)) {
+        std::cerr << "Cannot encode video: Unsupported codec parameters\n";
+        return false;
+    }
+    const std::streampos header_pos = out.tellp();
+    if (codec_flags) {
+        if (header_pos == std::streampos(-1)) {
+            std::cerr << "Cannot encode video: This codec needs an output that can seek\n";
+            return false;
+        }
+        format.flags |= codec_flags;
+    }
+    const uint8_t header_size = video::header_size(format);
+    uint8_t header[video::MAX_HEADER_SIZE];
+    video::write_header(format, header);
+    out.write(reinterpret_cast<const char *>(header), header_size);
+
+    // The grouped run length code is known up front, so segments are written out as soon as they're encoded
+    // A Huffman code or rANS model depends on the whole video, so those segments are kept as tokens until the end
+    std::unique_ptr<RunCode> code;
+    if (!codec_flags) {
+        code.reset(new GroupedRunCode(format.group_size));
+    }
+    SegmentEncoder encoder(format, code.get(), encode_timer, encode_workers);
+    std::vector<Segment> held;
+    // Byte offset of every keyframe from the start of the header, for the index
+    std::vector<uint32_t> keyframe_offsets;
+    size_t written = 0;
+    auto write_data = [&](const Segment &segment) {
+        keyframe_offsets.push_back(header_size + written);
+        out.write(segment.data.data(), segment.data.size());
+        written += segment.data.size();
+    };
+    // Segments are written as soon as they can be, so the output doesn't have to be held in memory
+    std::thread writer([&] {
+        Segment segment;
+        size_t encoded_frames = 0;
+        while (encoder.next(segment)) {
+            encoded_frames += segment.frame_count;
+            stats.frame_error += segment.frame_error;
+            stats.scrolled_frames += segment.scrolled_frames;
+            if (code) {
+                write_data(segment);
+            }
+            else {
+                held.push_back(std::move(segment));
+            }
+            std::cout << "Encoded " << (static_cast<double>(encoded_frames) / format.framerate) << " seconds\n";
+        }
+    });
+
+    // First frame is always a keyframe
+    Segment segment;
+    segment.frames.push_back(processed);
+    size_t count;
+    for (count = 1; next_frame(processed); count ++) {
+        if (video::is_keyframe(format, count)) {
+            encoder.push(std::move(segment));
+            segment = Segment();
+            segment.frames.reserve(format.keyframe_interval);
+        }
+        segment.frames.push_back(processed);
+    }
+    encoder.push(std::move(segment));
+    encoder.finish();
+    writer.join();
+    if (format.flags & video::HUFFMAN_RUNS) {
+        RunHistogram histogram{};
+        for (const Segment &segment : held) {
+            const RunHistogram runs = segment.tokens.run_histogram();
+            for (size_t symbol = 0; symbol < video::RUN_SYMBOLS; symbol ++) {
+                histogram[symbol] += runs[symbol];
+            }
+        }
+        HuffmanRunCode::make_code(histogram, format);
+        code.reset(new HuffmanRunCode(format));
+        for (Segment &segment : held) {
+            write_segment(segment, *code);
+            write_data(segment);
+        }
+    }
+    else if (format.flags & video::RANS_CODED) {
+        RansCoder::Counts counts;
+        for (const Segment &segment : held) {
+            RansCoder::count(segment.tokens, counts);
+        }
+        RansCoder::make_tables(counts, format);
+        const RansCoder coder(format);
+        for (Segment &segment : held) {
+            segment.data = coder.encode(segment.tokens);
+            segment.tokens = TokenStream();
+            write_data(segment);
+        }
+    }
+
+	// Append the keyframe index
+	format.index_offset = header_size + written;
+	for (uint32_t offset : keyframe_offsets) {
+		uint8_t entry[video::INDEX_ENTRY_SIZE];
+		video::write_be(entry, offset, sizeof(entry));
+		out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+	}
+	// Now that the frame count and index offset are known, put them in the header
+	format.frame_count = count;
+	if (header_pos != std::streampos(-1)) {
+		video::write_header(format, header);
+		out.seekp(header_pos);
+		out.write(reinterpret_cast<const char *>(header), header_size);
+		out.seekp(0, std::ios::end);
+	}
+
+    stats.width = format.width;
+    stats.height = format.height;
+    stats.frame_count = count;
+    stats.keyframes = keyframe_offsets.size();
+    stats.data_size = written;
+    return true;
+}
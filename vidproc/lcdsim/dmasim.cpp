@@ -0,0 +1,81 @@
+#include <algorithm>
+
+#include "delay.h"
+#include "stm32f10x.h"
+
+/*
+ * Model of TIM1 pacing DMA1 transfers to GPIO registers, which is all GDRAMDMA uses them for.
+ *
+ * Enabling TIM1 runs it until no more transfers are requested: in every period, each compare channel with its
+ * DMA request enabled copies the next word of its DMA1 channel to the BSRR it points at, in compare value
+ * order and at the compare time on the simulated clock. Transfer complete interrupts are taken right away.
+ */
+
+// Defined by the firmware
+extern "C" void DMA1_Channel4_IRQHandler();
+
+namespace mock {
+    TIM_TypeDef tim1;
+    DMA_Channel_TypeDef dma1_channels[7];
+    uint32_t dma1_flags = 0;
+    uint64_t dma1_transfers = 0;
+
+    // DMA1 channel (1-7) requested by each TIM1 compare channel, fixed by the hardware
+    static const uint8_t CC_DMA_CHANNELS[4] = { 2, 3, 6, 4 };
+
+    // Interrupt handlers of the DMA1 channels, where the firmware has one
+    static void (* const DMA1_HANDLERS[7])() = {
+        nullptr, nullptr, nullptr, DMA1_Channel4_IRQHandler, nullptr, nullptr, nullptr,
+    };
+
+    // Copy the next word of a channel to its peripheral
+    static void dma_transfer(unsigned int index) {
+        DMA_Channel_TypeDef &channel = dma1_channels[index];
+        *reinterpret_cast<GPIO_TypeDef::BitSetReset *>(channel.peripheral) =
+                *reinterpret_cast<const uint32_t *>(channel.memory);
+        dma1_transfers ++;
+        if (channel.memory_increment) {
+            channel.memory += sizeof(uint32_t);
+        }
+        if (-- channel.remaining == 0) {
+            // Global and transfer complete flags
+            dma1_flags |= 0x3u << (index * 4);
+            if (channel.tc_interrupt && DMA1_HANDLERS[index]) {
+                DMA1_HANDLERS[index]();
+            }
+        }
+    }
+} // namespace mock
+
+void TIM_Cmd(TIM_TypeDef *tim, FunctionalState state) {
+    tim->enabled = state;
+    if (tim == TIM4) {
+        mock::schedule_update(*tim);
+        return;
+    }
+    if (tim != TIM1 || !state) {
+        return;
+    }
+    // Compare channels in the order they go off within a period
+    unsigned int order[4] = { 0, 1, 2, 3 };
+    std::stable_sort(order, order + 4, [tim](unsigned int a, unsigned int b) {
+        return tim->pulses[a] < tim->pulses[b];
+    });
+    const uint64_t tick = tim->prescaler + 1;
+    uint64_t period_start = mock::cycles;
+    bool requested = true;
+    while (tim->enabled && requested) {
+        requested = false;
+        for (unsigned int cc : order) {
+            DMA_Channel_TypeDef &channel = mock::dma1_channels[mock::CC_DMA_CHANNELS[cc] - 1];
+            if (!tim->enabled || !(tim->dma_requests & TIM_DMA_CC1 << cc) || !channel.enabled
+                    || !channel.remaining) {
+                continue;
+            }
+            mock::cycles = std::max(mock::cycles, period_start + tim->pulses[cc] * tick);
+            mock::dma_transfer(mock::CC_DMA_CHANNELS[cc] - 1);
+            requested = true;
+        }
+        period_start += (tim->period + 1) * tick;
+    }
+}
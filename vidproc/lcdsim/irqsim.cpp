@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "delay.h"
+#include "stm32f10x.h"
+
+/*
+ * Model of interrupt masking and of TIM4, which paces the LCD queue (see lcdqueue.h).
+ *
+ * TIM4's update event happens at its time on the simulated clock, but there is no concurrency on the host, so
+ * its interrupt is only taken at the points where the firmware lets one in: when interrupts are unmasked, when
+ * the event is generated by software, and when the CPU sleeps with WFI. The firmware never relies on an
+ * interrupt running anywhere else, so this is enough to run the queue's state machine.
+ */
+
+// Defined by the firmware
+extern "C" void TIM4_IRQHandler();
+
+namespace mock {
+    uint32_t primask = 0;
+    TIM_TypeDef tim4;
+
+    void schedule_update(TIM_TypeDef &tim) {
+        if (tim.enabled) {
+            tim.next_update = cycles + static_cast<uint64_t>(tim.period + 1) * (tim.prescaler + 1);
+        }
+    }
+
+    // Raise the update flag if the simulated clock has reached the update event
+    static void update_timer(TIM_TypeDef &tim) {
+        if (!tim.enabled || cycles < tim.next_update) {
+            return;
+        }
+        tim.update_flag = true;
+        if (tim.one_pulse) {
+            tim.enabled = false;
+        }
+        else {
+            tim.next_update += static_cast<uint64_t>(tim.period + 1) * (tim.prescaler + 1);
+        }
+    }
+
+    static bool interrupt_pending() {
+        update_timer(tim4);
+        return tim4.update_flag && tim4.update_interrupt;
+    }
+
+    void take_interrupts() {
+        // The handler clears the flag, and the next event can only be in the future
+        while (!primask && interrupt_pending()) {
+            TIM4_IRQHandler();
+        }
+    }
+
+    void wait_for_interrupt() {
+        if (!interrupt_pending()) {
+            if (!tim4.enabled || !tim4.update_interrupt) {
+                // Nothing could ever wake the CPU up
+                std::fprintf(stderr, "WFI with no interrupt to come\n");
+                std::abort();
+            }
+            cycles = tim4.next_update;
+        }
+        take_interrupts();
+    }
+} // namespace mock
+
+ITStatus TIM_GetITStatus(TIM_TypeDef *tim, uint16_t) {
+    mock::cycles += mock::REGISTER_ACCESS_CYCLES;
+    mock::update_timer(*tim);
+    return tim->update_flag && tim->update_interrupt ? SET : RESET;
+}
+
+void TIM_GenerateEvent(TIM_TypeDef *tim, uint16_t) {
+    // The counter starts over
+    mock::schedule_update(*tim);
+    tim->update_flag = true;
+    mock::take_interrupts();
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "decoder.h"
+#include "delay.h"
+#include "lcd12864.h"
+#include "st7920sim.h"
+
+/*
+ * Replays a video through the real LCD driver and a simulated ST7920, and reports the bus traffic and
+ * estimated bus time per frame. The display is checked against every decoded frame.
+ *
+ * Usage: lcdbench <video.bin> [--timed] [--dump <screen.pbm>]
+ */
+
+int main(int argc, char **argv) {
+    const char *video_path = nullptr;
+    const char *dump_path = nullptr;
+    bool timed = false;
+    for (int i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "--timed")) {
+            timed = true;
+        }
+        else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+            dump_path = argv[++ i];
+        }
+        else {
+            video_path = argv[i];
+        }
+    }
+    if (!video_path) {
+        std::cerr << "Usage: lcdbench <video.bin> [--timed] [--dump <screen.pbm>]\n";
+        return 1;
+    }
+
+    std::ifstream in_file(video_path, std::ios::binary);
+    if (!in_file) {
+        std::cerr << "Cannot open " << video_path << "\n";
+        return 1;
+    }
+    // The decoder reads whole words, so keep the data word aligned and padded
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+    std::vector<uint32_t> words(bytes.size() / 4 + 1);
+    std::copy(bytes.begin(), bytes.end(), reinterpret_cast<char *>(words.data()));
+    VideoDecoder decoder(reinterpret_cast<const uint8_t *>(words.data()), bytes.size());
+
+    // Same wiring as the firmware
+    GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12), D7(GPIOC, GPIO_Pin_9),
+            D6(GPIOC, GPIO_Pin_8), D5(GPIOC, GPIO_Pin_7), D4(GPIOC, GPIO_Pin_6), D3(GPIOB, GPIO_Pin_15),
+            D2(GPIOB, GPIO_Pin_14), D1(GPIOB, GPIO_Pin_13), D0(GPIOB, GPIO_Pin_12);
+    ST7920Sim sim(RS, RW, E, { D0, D1, D2, D3, D4, D5, D6, D7 });
+    // Static, since it holds a few KB of buffers
+    static lcd::LCD12864 display(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7);
+
+    display.init();
+    display.set_timed_mode(timed);
+    display.start_draw();
+    display.clear_drawing();
+
+    const ST7920Sim::Stats start = sim.get_stats();
+    framebuf::Frame frame = {};
+    size_t frames = 0, mismatched = 0;
+    uint64_t total_cycles = 0, max_cycles = 0;
+    while (decoder.read_frame(frame)) {
+        memcpy(display.draw_buf, frame, sizeof(frame));
+        display.scroll_by(decoder.scrolled_lines());
+        uint64_t before = mock::cycles;
+        display.update_drawing(decoder.changed_words());
+        uint64_t elapsed = mock::cycles - before;
+        total_cycles += elapsed;
+        max_cycles = std::max(max_cycles, elapsed);
+        frames ++;
+
+        // Check the simulated screen against the frame
+        bool match = true;
+        for (unsigned int y = 0; y < framebuf::HEIGHT && match; y ++) {
+            for (unsigned int x = 0; x < framebuf::WIDTH; x ++) {
+                bool expected = *framebuf::pixel_byte(frame, x, y) & (0x80 >> x % 8);
+                if (sim.pixel(x, y) != expected) {
+                    match = false;
+                    break;
+                }
+            }
+        }
+        if (!match) {
+            mismatched ++;
+        }
+    }
+
+    if (dump_path) {
+        std::ofstream dump(dump_path, std::ios::binary);
+        sim.dump(dump);
+    }
+
+    const ST7920Sim::Stats &stats = sim.get_stats();
+    auto per_frame = [&](uint64_t value) {
+        return frames ? static_cast<double>(value) / frames : 0.0;
+    };
+    std::cout << "Frames: " << frames << (timed ? " (timed mode)" : " (busy flag)") << "\n"
+        << "Commands: " << stats.commands - start.commands << " (" << per_frame(stats.commands - start.commands)
+        << "/frame)\n"
+        << "Data writes: " << stats.data - start.data << " (" << per_frame(stats.data - start.data) << "/frame)\n"
+        << "Busy flag reads: " << stats.status_reads - start.status_reads << ", "
+        << stats.busy_reads - start.busy_reads << " found it busy\n"
+        << "Writes while busy: " << stats.writes_while_busy - start.writes_while_busy << "\n"
+        << "Writes after the address wrapped: " << stats.wrapped_writes - start.wrapped_writes << "\n"
+        << "Bus time: " << per_frame(total_cycles) / SYSCLK_FREQUENCY << "us/frame on average, "
+        << static_cast<double>(max_cycles) / SYSCLK_FREQUENCY << "us at most\n"
+        << "Frames not matching the display: " << mismatched << "\n";
+    return mismatched ? 2 : 0;
+}
@@ -0,0 +1,405 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "lcd12864.h"
+#include "lcdstatic.h"
+#include "serialencode.h"
+#include "st7920sim.h"
+#include "util.h"
+
+/*
+ * Host checks for the LCD driver, run against the mock GPIO ports (see mock/stm32f10x.h) and the simulated ST7920.
+ *
+ * Usage: lcdcheck
+ * Prints every check that fails, and exits with a non-zero status if any did.
+ */
+
+namespace {
+
+    unsigned int failures = 0;
+
+    void check(bool ok, const char *what) {
+        if (!ok) {
+            std::printf("FAILED: %s\n", what);
+            failures ++;
+        }
+    }
+
+    // Output registers of all the mock ports
+    struct PortState {
+        uint32_t odr[mock::GPIO_PORT_COUNT];
+
+        static PortState capture() {
+            PortState state;
+            for (unsigned int i = 0; i < mock::GPIO_PORT_COUNT; i ++) {
+                state.odr[i] = mock::gpio_port(i).ODR;
+            }
+            return state;
+        }
+        void restore() const {
+            for (unsigned int i = 0; i < mock::GPIO_PORT_COUNT; i ++) {
+                mock::gpio_port(i).ODR = odr[i];
+            }
+        }
+        bool operator==(const PortState &other) const {
+            for (unsigned int i = 0; i < mock::GPIO_PORT_COUNT; i ++) {
+                if (odr[i] != other.odr[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // Gives access to the driver's data port
+    class DataPortProbe : public lcd::LCD12864 {
+    public:
+        using LCD12864::LCD12864;
+        using LCDBase::set_data_port;
+
+        // The pin at a time writes that the BSRR tables replaced
+        void set_data_port_per_pin(uint8_t data) {
+            if (!FOUR_WIRE_INTERFACE) {
+                D0 = data & 0x01;
+                D1 = data & 0x02;
+                D2 = data & 0x04;
+                D3 = data & 0x08;
+                D4 = data & 0x10;
+                D5 = data & 0x20;
+                D6 = data & 0x40;
+                D7 = data & 0x80;
+            }
+            else {
+                data &= 0x0F;
+                D4 = data & 0x01;
+                D5 = data & 0x02;
+                D6 = data & 0x04;
+                D7 = data & 0x08;
+            }
+        }
+    };
+
+    // Every byte written through the BSRR tables must leave the ports exactly as writing one pin at a time did,
+    // including the pins that aren't part of the data bus
+    bool data_port_matches(DataPortProbe &probe) {
+        const uint32_t starts[] = { 0x0000, 0xFFFF, 0xA5C3 };
+        for (uint32_t start : starts) {
+            for (unsigned int value = 0; value < 256; value ++) {
+                for (unsigned int i = 0; i < mock::GPIO_PORT_COUNT; i ++) {
+                    mock::gpio_port(i).ODR = start;
+                }
+                const PortState before = PortState::capture();
+                probe.set_data_port_per_pin(value);
+                const PortState expected = PortState::capture();
+                before.restore();
+                probe.set_data_port(value);
+                if (!(PortState::capture() == expected)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void check_data_port() {
+        // Same wiring as the firmware: D0-D3 on GPIOB, D4-D7 on GPIOC
+        GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12);
+        std::unique_ptr<DataPortProbe> firmware(new DataPortProbe(RS, RW, E,
+                { GPIOB, GPIO_Pin_12 }, { GPIOB, GPIO_Pin_13 }, { GPIOB, GPIO_Pin_14 }, { GPIOB, GPIO_Pin_15 },
+                { GPIOC, GPIO_Pin_6 }, { GPIOC, GPIO_Pin_7 }, { GPIOC, GPIO_Pin_8 }, { GPIOC, GPIO_Pin_9 }));
+        check(data_port_matches(*firmware), "BSRR tables match per-pin writes with the firmware wiring");
+
+        // Pins out of order, on three ports, and on both sides of the CRL/CRH split
+        std::unique_ptr<DataPortProbe> scattered(new DataPortProbe(RS, RW, E,
+                { GPIOA, GPIO_Pin_8 }, { GPIOB, GPIO_Pin_0 }, { GPIOA, GPIO_Pin_7 }, { GPIOD, GPIO_Pin_2 },
+                { GPIOB, GPIO_Pin_15 }, { GPIOA, GPIO_Pin_0 }, { GPIOD, GPIO_Pin_11 }, { GPIOB, GPIO_Pin_3 }));
+        check(data_port_matches(*scattered), "BSRR tables match per-pin writes with pins on three ports");
+
+        std::unique_ptr<DataPortProbe> four_wire(new DataPortProbe(RS, RW, E,
+                { GPIOC, GPIO_Pin_6 }, { GPIOB, GPIO_Pin_7 }, { GPIOC, GPIO_Pin_8 }, { GPIOB, GPIO_Pin_9 }));
+        check(data_port_matches(*four_wire), "BSRR tables match per-pin writes in four wire interface");
+    }
+
+    const framebuf::DirtyMask ALL_DIRTY = {
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+    };
+
+    // Rows the test picture is panned up by in frame t; it goes up, then back down
+    int test_pan(unsigned int t) {
+        return t < 30 ? t : 60 - static_cast<int>(t);
+    }
+
+    // Frame t of a test video: a pattern that pans vertically, and a block that moves on its own
+    void draw_test_frame(framebuf::Frame frame, unsigned int t) {
+        for (unsigned int y = 0; y < framebuf::HEIGHT; y ++) {
+            unsigned int row = y + 64 + test_pan(t);
+            for (unsigned int x = 0; x < framebuf::WIDTH; x ++) {
+                bool block = x - (t * 7) % 100 < 24 && y - (t * 3) % 48 < 12;
+                bool on = ((x / 5 + row / 3) % 7 < 2) != (x * row % 11 == 0) || block;
+                uint8_t bit = 0x80 >> x % 8;
+                uint8_t *byte = framebuf::pixel_byte(frame, x, y);
+                *byte = on ? *byte | bit : *byte & ~bit;
+            }
+        }
+    }
+
+    bool display_matches(const ST7920Sim &sim, framebuf::Frame frame) {
+        for (unsigned int y = 0; y < framebuf::HEIGHT; y ++) {
+            for (unsigned int x = 0; x < framebuf::WIDTH; x ++) {
+                if (sim.pixel(x, y) != static_cast<bool>(*framebuf::pixel_byte(frame, x, y) & 0x80 >> x % 8)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Send updates through GDRAMDMA's BSRR streams, replayed by the simulated TIM1 and DMA1 (see dmasim.cpp),
+    // and check what the LCD ends up showing
+    void check_gdram_dma() {
+        GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12), D7(GPIOC, GPIO_Pin_9),
+                D6(GPIOC, GPIO_Pin_8), D5(GPIOC, GPIO_Pin_7), D4(GPIOC, GPIO_Pin_6), D3(GPIOB, GPIO_Pin_15),
+                D2(GPIOB, GPIO_Pin_14), D1(GPIOB, GPIO_Pin_13), D0(GPIOB, GPIO_Pin_12);
+        ST7920Sim sim(RS, RW, E, { D0, D1, D2, D3, D4, D5, D6, D7 });
+        std::unique_ptr<lcd::LCD12864> display(new lcd::LCD12864(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7));
+        display->init();
+        display->start_draw();
+        display->clear_drawing();
+
+        const ST7920Sim::Stats start = sim.get_stats();
+        const uint64_t start_transfers = mock::dma1_transfers;
+        bool updates_done = true, frames_match = true;
+        framebuf::Frame frame = {};
+        for (unsigned int t = 0; t < 60; t ++) {
+            draw_test_frame(frame, t);
+            memcpy(display->draw_buf, frame, sizeof(frame));
+            display->scroll_by(t ? test_pan(t) - test_pan(t - 1) : 0);
+            // Every third update is sent by the CPU, so the hand-off between the two is covered too
+            if (t % 3 == 2) {
+                display->update_drawing(ALL_DIRTY);
+            }
+            else {
+                display->start_update_drawing(ALL_DIRTY);
+                updates_done &= !display->is_updating();
+            }
+            frames_match &= display_matches(sim, frame);
+        }
+        const ST7920Sim::Stats &stats = sim.get_stats();
+
+        check(mock::dma1_transfers != start_transfers, "Firmware wiring is sent by DMA");
+        check(updates_done, "DMA updates finish with the transfer complete interrupt");
+        check(frames_match, "Display matches every frame sent by DMA");
+        check(stats.writes_while_busy == start.writes_while_busy, "DMA writes wait out the execution time");
+        check(stats.wrapped_writes == start.wrapped_writes, "DMA writes stay within GDRAM rows");
+    }
+
+    // The firmware's wiring, fixed at compile time (see main.cpp)
+    typedef lcd::StaticPinMap<lcd::StaticPin<GPIOC_BASE, GPIO_Pin_10>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_11>,
+            lcd::StaticPin<GPIOC_BASE, GPIO_Pin_12>, lcd::StaticPin<GPIOB_BASE, GPIO_Pin_12>,
+            lcd::StaticPin<GPIOB_BASE, GPIO_Pin_13>, lcd::StaticPin<GPIOB_BASE, GPIO_Pin_14>,
+            lcd::StaticPin<GPIOB_BASE, GPIO_Pin_15>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_6>,
+            lcd::StaticPin<GPIOC_BASE, GPIO_Pin_7>, lcd::StaticPin<GPIOC_BASE, GPIO_Pin_8>,
+            lcd::StaticPin<GPIOC_BASE, GPIO_Pin_9>> StaticFirmwarePins;
+
+    // Everything a driver did on the bus
+    struct BusTrace {
+        std::vector<ST7920Sim::Write> writes;
+        std::vector<uint16_t> bus;
+        ST7920Sim::Stats stats;
+        bool frames_match = true;
+    };
+
+    // Power on a driver made by make_display with the firmware wiring, and play the test video on it
+    template <typename Display, typename Make>
+    BusTrace trace_display(Make make_display, bool timed) {
+        // Start from the reset state of the ports
+        for (unsigned int i = 0; i < mock::GPIO_PORT_COUNT; i ++) {
+            new (&mock::gpio_port(i)) GPIO_TypeDef();
+        }
+        GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12), D7(GPIOC, GPIO_Pin_9),
+                D6(GPIOC, GPIO_Pin_8), D5(GPIOC, GPIO_Pin_7), D4(GPIOC, GPIO_Pin_6), D3(GPIOB, GPIO_Pin_15),
+                D2(GPIOB, GPIO_Pin_14), D1(GPIOB, GPIO_Pin_13), D0(GPIOB, GPIO_Pin_12);
+        ST7920Sim sim(RS, RW, E, { D0, D1, D2, D3, D4, D5, D6, D7 });
+        BusTrace trace;
+        sim.set_logs(&trace.writes, &trace.bus);
+
+        std::unique_ptr<Display> display(make_display(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7));
+        display->init();
+        display->set_timed_mode(timed);
+        display->start_draw();
+        display->clear_drawing();
+        framebuf::Frame frame = {};
+        for (unsigned int t = 0; t < 60; t ++) {
+            draw_test_frame(frame, t);
+            memcpy(display->draw_buf, frame, sizeof(frame));
+            display->scroll_by(t ? test_pan(t) - test_pan(t - 1) : 0);
+            display->update_drawing(ALL_DIRTY);
+            trace.frames_match &= display_matches(sim, frame);
+        }
+        display->end_draw();
+
+        sim.set_logs(nullptr, nullptr);
+        trace.stats = sim.get_stats();
+        return trace;
+    }
+
+    // The driver with the pins fixed at compile time must do exactly what the runtime one does on the bus
+    void check_static_driver() {
+        typedef lcd::StaticLCD12864<StaticFirmwarePins> StaticDisplay;
+        for (bool timed : { false, true }) {
+            BusTrace runtime = trace_display<lcd::LCD12864>([](GPIOPin RS, GPIOPin RW, GPIOPin E, GPIOPin D0,
+                    GPIOPin D1, GPIOPin D2, GPIOPin D3, GPIOPin D4, GPIOPin D5, GPIOPin D6, GPIOPin D7) {
+                return new lcd::LCD12864(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7);
+            }, timed);
+            BusTrace fixed = trace_display<StaticDisplay>([](GPIOPin, GPIOPin, GPIOPin, GPIOPin, GPIOPin, GPIOPin,
+                    GPIOPin, GPIOPin, GPIOPin, GPIOPin, GPIOPin) {
+                return new StaticDisplay();
+            }, timed);
+
+            check(runtime.frames_match && fixed.frames_match, timed ? "Both drivers show every frame in timed mode"
+                    : "Both drivers show every frame");
+            check(runtime.writes == fixed.writes, timed ? "Static driver sends the same writes in timed mode"
+                    : "Static driver sends the same writes");
+            check(runtime.bus == fixed.bus, timed ? "Static driver drives the bus pins the same way in timed mode"
+                    : "Static driver drives the bus pins the same way");
+            check(fixed.stats.writes_while_busy == runtime.stats.writes_while_busy
+                    && fixed.stats.status_reads == runtime.stats.status_reads,
+                    timed ? "Static driver waits for the controller the same way in timed mode"
+                    : "Static driver waits for the controller the same way");
+        }
+    }
+
+    // Send everything through the queue, with TIM4's interrupt simulated on the mock clock (see irqsim.cpp), and
+    // check that the LCD gets the same writes as from the blocking driver
+    // Every third frame is sent with interrupts masked by the caller, where the queue has to send the writes itself
+    void check_queued_mode() {
+        for (bool timed : { false, true }) {
+            BusTrace direct = trace_display<lcd::LCD12864>([](GPIOPin RS, GPIOPin RW, GPIOPin E, GPIOPin D0,
+                    GPIOPin D1, GPIOPin D2, GPIOPin D3, GPIOPin D4, GPIOPin D5, GPIOPin D6, GPIOPin D7) {
+                return new lcd::LCD12864(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7);
+            }, timed);
+
+            GPIOPin RS(GPIOC, GPIO_Pin_10), RW(GPIOC, GPIO_Pin_11), E(GPIOC, GPIO_Pin_12), D7(GPIOC, GPIO_Pin_9),
+                    D6(GPIOC, GPIO_Pin_8), D5(GPIOC, GPIO_Pin_7), D4(GPIOC, GPIO_Pin_6), D3(GPIOB, GPIO_Pin_15),
+                    D2(GPIOB, GPIO_Pin_14), D1(GPIOB, GPIO_Pin_13), D0(GPIOB, GPIO_Pin_12);
+            ST7920Sim sim(RS, RW, E, { D0, D1, D2, D3, D4, D5, D6, D7 });
+            std::vector<ST7920Sim::Write> writes;
+            sim.set_logs(&writes, nullptr);
+            std::unique_ptr<lcd::LCD12864> display(new lcd::LCD12864(RS, RW, E, D0, D1, D2, D3, D4, D5, D6, D7));
+            display->init();
+            display->set_timed_mode(timed);
+            display->set_queued_mode(true);
+            display->start_draw();
+            display->clear_drawing();
+
+            const ST7920Sim::Stats start = sim.get_stats();
+            framebuf::Frame frame = {};
+            bool frames_match = display_matches(sim, frame), backlog_seen = false;
+            for (unsigned int t = 0; t < 60; t ++) {
+                draw_test_frame(frame, t);
+                memcpy(display->draw_buf, frame, sizeof(frame));
+                display->scroll_by(t ? test_pan(t) - test_pan(t - 1) : 0);
+                if (t % 3 == 2) {
+                    NoInterrupt noi;
+                    display->update_drawing(ALL_DIRTY);
+                    display->flush();
+                }
+                else {
+                    display->update_drawing(ALL_DIRTY);
+                    backlog_seen |= display->get_queue_depth() != 0;
+                    display->flush();
+                }
+                frames_match &= display_matches(sim, frame) && display->get_queue_depth() == 0;
+            }
+            display->end_draw();
+            sim.set_logs(nullptr, nullptr);
+            const ST7920Sim::Stats &stats = sim.get_stats();
+            const lcd::LCDQueue::Stats &queue_stats = display->get_queue_stats();
+            display->set_queued_mode(false);
+
+            check(frames_match, timed ? "Display matches every frame sent from the queue in timed mode"
+                    : "Display matches every frame sent from the queue");
+            check(backlog_seen && queue_stats.stalls && queue_stats.max_depth == LCD_QUEUE_SIZE - 1,
+                    timed ? "Updates fill the queue and wait for room in timed mode"
+                    : "Updates fill the queue and wait for room");
+            check(writes == direct.writes, timed ? "Queued writes are the same as the blocking driver's in timed mode"
+                    : "Queued writes are the same as the blocking driver's");
+            check(stats.writes_while_busy == start.writes_while_busy, timed
+                    ? "Queued writes wait out the execution time in timed mode"
+                    : "Queued writes wait out the execution time");
+        }
+    }
+
+    // What the ST7920 takes from a serial stream, shifted in MSB first: five 1s to synchronize, RW, RS and a 0,
+    // then D7-D4 followed by four 0s, and D3-D0 followed by four 0s
+    // Returns false if the stream breaks that framing anywhere
+    bool receive_serial(const uint8_t *bytes, uint16_t size, std::vector<lcd::BusWrite> &writes) {
+        std::vector<bool> bits;
+        for (uint16_t i = 0; i < size; i ++) {
+            for (int bit = 7; bit >= 0; bit --) {
+                bits.push_back(bytes[i] >> bit & 1);
+            }
+        }
+        if (bits.size() % 24) {
+            return false;
+        }
+        for (size_t start = 0; start < bits.size(); start += 24) {
+            auto field = [&](size_t from, size_t count) {
+                unsigned int value = 0;
+                for (size_t i = from; i < from + count; i ++) {
+                    value = value << 1 | bits[start + i];
+                }
+                return value;
+            };
+            bool rw = field(5, 1), rs = field(6, 1);
+            if (field(0, 5) != 0x1F || rw || field(7, 1) || field(12, 4) || field(20, 4)) {
+                return false;
+            }
+            writes.push_back({ static_cast<uint8_t>(field(8, 4) << 4 | field(16, 4)), rs });
+        }
+        return true;
+    }
+
+    // The serial bus sends every command and data byte in the ST7920's serial framing
+    void check_serial_encoding() {
+        std::vector<lcd::BusWrite> sent;
+        for (bool data : { false, true }) {
+            for (unsigned int value = 0; value < 256; value ++) {
+                sent.push_back({ static_cast<uint8_t>(value), data });
+            }
+        }
+        std::vector<uint8_t> bytes(sent.size() * lcd::SERIAL_BYTES_PER_WRITE);
+        uint16_t size = lcd::encode_serial(sent.data(), sent.size(), bytes.data());
+        check(size == bytes.size(), "Serial writes take three bytes each");
+
+        std::vector<lcd::BusWrite> received;
+        bool framed = receive_serial(bytes.data(), size, received);
+        check(framed, "Serial writes start with the sync byte and put the nibbles in the upper halves");
+        bool same = framed && received.size() == sent.size();
+        for (size_t i = 0; same && i < sent.size(); i ++) {
+            same = received[i].value == sent[i].value && received[i].data == sent[i].data;
+        }
+        check(same, "Serial writes carry RS and the value");
+    }
+} // namespace
+
+int main() {
+    check_data_port();
+    check_gdram_dma();
+    check_static_driver();
+    check_queued_mode();
+    check_serial_encoding();
+
+    if (failures) {
+        std::printf("%u checks failed\n", failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}
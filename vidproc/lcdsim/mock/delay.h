@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SYSCLK_FREQUENCY 72 // MHz
+
+namespace mock {
+    // Simulated CPU time, in system clock cycles
+    extern uint64_t cycles;
+    // Cycles charged for each access to a GPIO register or the cycle counter
+    constexpr uint32_t REGISTER_ACCESS_CYCLES = 2;
+} // namespace mock
+
+// Delays only advance the simulated clock
+namespace delay {
+    inline void cycles(uint32_t count) {
+        mock::cycles += count;
+    }
+    inline void init_cycle_counter() {}
+    inline uint32_t cycle_count() {
+        // Polling the counter has to take time, or timed waits would never end
+        mock::cycles += mock::REGISTER_ACCESS_CYCLES;
+        return static_cast<uint32_t>(mock::cycles);
+    }
+    inline void sec(uint16_t s) {
+        mock::cycles += static_cast<uint64_t>(s) * SYSCLK_FREQUENCY * 1000000;
+    }
+    inline void ms(uint16_t ms) {
+        mock::cycles += static_cast<uint64_t>(ms) * SYSCLK_FREQUENCY * 1000;
+    }
+    inline void us(uint16_t us) {
+        mock::cycles += static_cast<uint64_t>(us) * SYSCLK_FREQUENCY;
+    }
+} // namespace delay
@@ -0,0 +1,359 @@
+#pragma once
+
+/*
+ * Host stand-in for the parts of the CMSIS and SPL headers that the LCD driver uses.
+ *
+ * GPIO registers are objects that report every write to the simulator (see st7920sim.h), and reads of IDR see
+ * whatever the simulated LCD is driving. TIM1 and DMA1 run the transfers GDRAMDMA sets up (see dmasim.cpp), and
+ * TIM4 raises the LCD queue's interrupt on the simulated clock (see irqsim.cpp). Everything else the driver
+ * touches (RCC, NVIC, the other timers) does nothing.
+ */
+
+#include <stdint.h>
+
+// glibc defines SIZE_WIDTH in stdint.h, which clashes with lcd::SIZE_WIDTH
+#undef SIZE_WIDTH
+
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+
+namespace mock {
+    // Whether interrupts are masked
+    extern uint32_t primask;
+    // Take the interrupts that are pending, unless they're masked (see irqsim.cpp)
+    void take_interrupts();
+    // Let the simulated clock run until an interrupt is pending
+    void wait_for_interrupt();
+} // namespace mock
+
+// Interrupts are only taken when they're unmasked and when the CPU sleeps, which is all the firmware relies on
+inline uint32_t __get_PRIMASK() {
+    return mock::primask;
+}
+inline void __disable_irq() {
+    mock::primask = 1;
+}
+inline void __enable_irq() {
+    mock::primask = 0;
+    mock::take_interrupts();
+}
+inline void __DMB() {}
+inline void __WFI() {
+    mock::wait_for_interrupt();
+}
+
+struct GPIO_TypeDef;
+
+namespace mock {
+    // Called after every write to a port's output
+    void gpio_written(GPIO_TypeDef *port);
+    // Value of a port's input data register
+    uint32_t gpio_input(const GPIO_TypeDef *port);
+} // namespace mock
+
+struct GPIO_TypeDef {
+    // BSRR and BRR: write-only, set or reset bits of ODR
+    struct BitSetReset {
+        GPIO_TypeDef * const port;
+        const bool reset_only;
+
+        BitSetReset& operator=(uint32_t value) {
+            if (reset_only) {
+                port->ODR &= ~(value & 0xFFFF);
+            }
+            else {
+                port->ODR = (port->ODR | (value & 0xFFFF)) & ~(value >> 16 & ~value & 0xFFFF);
+            }
+            mock::gpio_written(port);
+            return *this;
+        }
+    };
+    // IDR: read-only
+    struct Input {
+        const GPIO_TypeDef * const port;
+
+        operator uint32_t() const {
+            return mock::gpio_input(port);
+        }
+    };
+
+    uint32_t CRL = 0x44444444;
+    uint32_t CRH = 0x44444444;
+    Input IDR{this};
+    uint32_t ODR = 0;
+    BitSetReset BSRR{this, false};
+    BitSetReset BRR{this, true};
+    uint32_t LCKR = 0;
+
+    GPIO_TypeDef() = default;
+    GPIO_TypeDef(const GPIO_TypeDef &) = delete;
+};
+
+// The ports are mapped at their real addresses (see st7920sim.cpp), so code that gets a port from its base
+// address, like StaticPin, reaches the mock ports too
+#define GPIOA_BASE ((uint32_t) 0x40010800)
+#define GPIOB_BASE ((uint32_t) 0x40010C00)
+#define GPIOC_BASE ((uint32_t) 0x40011000)
+#define GPIOD_BASE ((uint32_t) 0x40011400)
+#define GPIOE_BASE ((uint32_t) 0x40011800)
+#define GPIOF_BASE ((uint32_t) 0x40011C00)
+#define GPIOG_BASE ((uint32_t) 0x40012000)
+
+#define GPIOA (reinterpret_cast<GPIO_TypeDef *>(GPIOA_BASE))
+#define GPIOB (reinterpret_cast<GPIO_TypeDef *>(GPIOB_BASE))
+#define GPIOC (reinterpret_cast<GPIO_TypeDef *>(GPIOC_BASE))
+#define GPIOD (reinterpret_cast<GPIO_TypeDef *>(GPIOD_BASE))
+#define GPIOE (reinterpret_cast<GPIO_TypeDef *>(GPIOE_BASE))
+#define GPIOF (reinterpret_cast<GPIO_TypeDef *>(GPIOF_BASE))
+#define GPIOG (reinterpret_cast<GPIO_TypeDef *>(GPIOG_BASE))
+
+namespace mock {
+    constexpr unsigned int GPIO_PORT_COUNT = 7;
+    // Port 0 is GPIOA
+    inline GPIO_TypeDef& gpio_port(unsigned int index) {
+        return *reinterpret_cast<GPIO_TypeDef *>(GPIOA_BASE + index * (GPIOB_BASE - GPIOA_BASE));
+    }
+} // namespace mock
+
+#define GPIO_Pin_0 ((uint16_t) 0x0001)
+#define GPIO_Pin_1 ((uint16_t) 0x0002)
+#define GPIO_Pin_2 ((uint16_t) 0x0004)
+#define GPIO_Pin_3 ((uint16_t) 0x0008)
+#define GPIO_Pin_4 ((uint16_t) 0x0010)
+#define GPIO_Pin_5 ((uint16_t) 0x0020)
+#define GPIO_Pin_6 ((uint16_t) 0x0040)
+#define GPIO_Pin_7 ((uint16_t) 0x0080)
+#define GPIO_Pin_8 ((uint16_t) 0x0100)
+#define GPIO_Pin_9 ((uint16_t) 0x0200)
+#define GPIO_Pin_10 ((uint16_t) 0x0400)
+#define GPIO_Pin_11 ((uint16_t) 0x0800)
+#define GPIO_Pin_12 ((uint16_t) 0x1000)
+#define GPIO_Pin_13 ((uint16_t) 0x2000)
+#define GPIO_Pin_14 ((uint16_t) 0x4000)
+#define GPIO_Pin_15 ((uint16_t) 0x8000)
+
+// Same values as the SPL, since the driver encodes them into CRL and CRH itself
+typedef enum {
+    GPIO_Speed_10MHz = 1,
+    GPIO_Speed_2MHz,
+    GPIO_Speed_50MHz
+} GPIOSpeed_TypeDef;
+typedef enum {
+    GPIO_Mode_AIN = 0x0,
+    GPIO_Mode_IN_FLOATING = 0x04,
+    GPIO_Mode_IPD = 0x28,
+    GPIO_Mode_IPU = 0x48,
+    GPIO_Mode_Out_OD = 0x14,
+    GPIO_Mode_Out_PP = 0x10,
+    GPIO_Mode_AF_OD = 0x1C,
+    GPIO_Mode_AF_PP = 0x18
+} GPIOMode_TypeDef;
+typedef enum {
+    Bit_RESET = 0,
+    Bit_SET
+} BitAction;
+
+typedef struct {
+    uint16_t GPIO_Pin;
+    GPIOSpeed_TypeDef GPIO_Speed;
+    GPIOMode_TypeDef GPIO_Mode;
+} GPIO_InitTypeDef;
+
+void GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init);
+void GPIO_WriteBit(GPIO_TypeDef *port, uint16_t pin, BitAction value);
+uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef *port, uint16_t pin);
+
+#define RCC_APB2Periph_GPIOA ((uint32_t) 0x00000004)
+#define RCC_APB2Periph_GPIOB ((uint32_t) 0x00000008)
+#define RCC_APB2Periph_GPIOC ((uint32_t) 0x00000010)
+#define RCC_APB2Periph_GPIOD ((uint32_t) 0x00000020)
+#define RCC_APB2Periph_GPIOE ((uint32_t) 0x00000040)
+#define RCC_APB2Periph_GPIOF ((uint32_t) 0x00000080)
+#define RCC_APB2Periph_GPIOG ((uint32_t) 0x00000100)
+#define RCC_APB2Periph_TIM1 ((uint32_t) 0x00000800)
+#define RCC_APB1Periph_TIM4 ((uint32_t) 0x00000004)
+#define RCC_AHBPeriph_DMA1 ((uint32_t) 0x00000001)
+
+inline void RCC_APB1PeriphClockCmd(uint32_t, FunctionalState) {}
+inline void RCC_APB2PeriphClockCmd(uint32_t, FunctionalState) {}
+inline void RCC_AHBPeriphClockCmd(uint32_t, FunctionalState) {}
+
+typedef enum { DMA1_Channel4_IRQn = 14, TIM4_IRQn = 30 } IRQn_Type;
+typedef struct {
+    uint8_t NVIC_IRQChannel;
+    uint8_t NVIC_IRQChannelPreemptionPriority;
+    uint8_t NVIC_IRQChannelSubPriority;
+    FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+inline void NVIC_Init(NVIC_InitTypeDef *) {}
+
+// Only what the simulations need: the time base, the compare values and DMA requests for TIM1's transfers, and
+// the update event for TIM4's interrupt
+struct TIM_TypeDef {
+    uint16_t prescaler = 0;
+    uint16_t period = 0;
+    uint16_t pulses[4] = {};
+    uint16_t dma_requests = 0;
+    bool enabled = false;
+    bool one_pulse = false;
+    bool update_interrupt = false;
+    // UIF
+    bool update_flag = false;
+    // Simulated time of the next update event, while enabled
+    uint64_t next_update = 0;
+};
+namespace mock {
+    extern TIM_TypeDef tim1;
+    extern TIM_TypeDef tim4;
+    // Start a period of TIM4 from now, or stop it
+    void schedule_update(TIM_TypeDef &tim);
+} // namespace mock
+#define TIM1 (&mock::tim1)
+#define TIM4 (&mock::tim4)
+
+typedef struct {
+    uint16_t TIM_Prescaler;
+    uint16_t TIM_CounterMode;
+    uint16_t TIM_Period;
+    uint16_t TIM_ClockDivision;
+    uint8_t TIM_RepetitionCounter;
+} TIM_TimeBaseInitTypeDef;
+
+#define TIM_CounterMode_Up ((uint16_t) 0x0000)
+#define TIM_CKD_DIV1 ((uint16_t) 0x0000)
+#define TIM_OPMode_Single ((uint16_t) 0x0008)
+#define TIM_IT_Update ((uint16_t) 0x0001)
+#define TIM_EventSource_Update ((uint16_t) 0x0001)
+
+typedef struct {
+    uint16_t TIM_OCMode;
+    uint16_t TIM_Pulse;
+} TIM_OCInitTypeDef;
+
+#define TIM_OCMode_Timing ((uint16_t) 0x0000)
+#define TIM_DMA_CC1 ((uint16_t) 0x0200)
+#define TIM_DMA_CC2 ((uint16_t) 0x0400)
+#define TIM_DMA_CC3 ((uint16_t) 0x0800)
+#define TIM_DMA_CC4 ((uint16_t) 0x1000)
+
+inline void TIM_TimeBaseInit(TIM_TypeDef *tim, TIM_TimeBaseInitTypeDef *init) {
+    tim->prescaler = init->TIM_Prescaler;
+    tim->period = init->TIM_Period;
+}
+inline void TIM_OCStructInit(TIM_OCInitTypeDef *init) {
+    *init = { TIM_OCMode_Timing, 0 };
+}
+inline void TIM_OC1Init(TIM_TypeDef *tim, TIM_OCInitTypeDef *init) {
+    tim->pulses[0] = init->TIM_Pulse;
+}
+inline void TIM_OC2Init(TIM_TypeDef *tim, TIM_OCInitTypeDef *init) {
+    tim->pulses[1] = init->TIM_Pulse;
+}
+inline void TIM_OC3Init(TIM_TypeDef *tim, TIM_OCInitTypeDef *init) {
+    tim->pulses[2] = init->TIM_Pulse;
+}
+inline void TIM_OC4Init(TIM_TypeDef *tim, TIM_OCInitTypeDef *init) {
+    tim->pulses[3] = init->TIM_Pulse;
+}
+inline void TIM_DMACmd(TIM_TypeDef *tim, uint16_t requests, FunctionalState state) {
+    tim->dma_requests = state ? tim->dma_requests | requests : tim->dma_requests & ~requests;
+}
+inline void TIM_SelectOnePulseMode(TIM_TypeDef *tim, uint16_t mode) {
+    tim->one_pulse = mode == TIM_OPMode_Single;
+}
+inline void TIM_ClearITPendingBit(TIM_TypeDef *tim, uint16_t) {
+    tim->update_flag = false;
+}
+inline void TIM_ITConfig(TIM_TypeDef *tim, uint16_t, FunctionalState state) {
+    tim->update_interrupt = state;
+}
+inline void TIM_SetAutoreload(TIM_TypeDef *tim, uint16_t period) {
+    tim->period = period;
+}
+// The counter always starts over when the timer is enabled, which is the only way the firmware uses it
+inline void TIM_SetCounter(TIM_TypeDef *, uint16_t) {}
+// Enabling TIM1 runs its DMA transfers to the end (see dmasim.cpp); enabling TIM4 schedules its next update
+void TIM_Cmd(TIM_TypeDef *tim, FunctionalState state);
+// Polling the flag takes time, like polling the cycle counter
+ITStatus TIM_GetITStatus(TIM_TypeDef *tim, uint16_t);
+// Sets the update flag, which calls the interrupt right away if it's enabled and unmasked
+void TIM_GenerateEvent(TIM_TypeDef *tim, uint16_t);
+
+// DMA1: addresses are host pointers, so they are as wide as uintptr_t
+struct DMA_Channel_TypeDef {
+    bool enabled = false;
+    bool tc_interrupt = false;
+    uintptr_t peripheral = 0;
+    uintptr_t memory = 0;
+    bool memory_increment = false;
+    uint16_t remaining = 0;
+};
+namespace mock {
+    // Channels 1-7 of DMA1
+    extern DMA_Channel_TypeDef dma1_channels[7];
+    // Interrupt flags of DMA1, in the layout of its ISR register
+    extern uint32_t dma1_flags;
+    // Number of words copied by DMA1 so far
+    extern uint64_t dma1_transfers;
+} // namespace mock
+#define DMA1_Channel1 (&mock::dma1_channels[0])
+#define DMA1_Channel2 (&mock::dma1_channels[1])
+#define DMA1_Channel3 (&mock::dma1_channels[2])
+#define DMA1_Channel4 (&mock::dma1_channels[3])
+#define DMA1_Channel5 (&mock::dma1_channels[4])
+#define DMA1_Channel6 (&mock::dma1_channels[5])
+#define DMA1_Channel7 (&mock::dma1_channels[6])
+
+typedef struct {
+    uintptr_t DMA_PeripheralBaseAddr;
+    uintptr_t DMA_MemoryBaseAddr;
+    uint32_t DMA_DIR;
+    uint32_t DMA_BufferSize;
+    uint32_t DMA_PeripheralInc;
+    uint32_t DMA_MemoryInc;
+    uint32_t DMA_PeripheralDataSize;
+    uint32_t DMA_MemoryDataSize;
+    uint32_t DMA_Mode;
+    uint32_t DMA_Priority;
+    uint32_t DMA_M2M;
+} DMA_InitTypeDef;
+
+#define DMA_DIR_PeripheralDST ((uint32_t) 0x00000010)
+#define DMA_PeripheralInc_Disable ((uint32_t) 0x00000000)
+#define DMA_MemoryInc_Enable ((uint32_t) 0x00000080)
+#define DMA_MemoryInc_Disable ((uint32_t) 0x00000000)
+#define DMA_PeripheralDataSize_Word ((uint32_t) 0x00000200)
+#define DMA_MemoryDataSize_Word ((uint32_t) 0x00000800)
+#define DMA_Mode_Normal ((uint32_t) 0x00000000)
+#define DMA_Priority_High ((uint32_t) 0x00002000)
+#define DMA_M2M_Disable ((uint32_t) 0x00000000)
+#define DMA_IT_TC ((uint32_t) 0x00000002)
+#define DMA1_IT_GL4 ((uint32_t) 0x00001000)
+#define DMA1_IT_TC4 ((uint32_t) 0x00002000)
+
+inline void DMA_Init(DMA_Channel_TypeDef *channel, DMA_InitTypeDef *init) {
+    channel->peripheral = init->DMA_PeripheralBaseAddr;
+    channel->memory = init->DMA_MemoryBaseAddr;
+    channel->memory_increment = init->DMA_MemoryInc == DMA_MemoryInc_Enable;
+    channel->remaining = init->DMA_BufferSize;
+}
+inline void DMA_Cmd(DMA_Channel_TypeDef *channel, FunctionalState state) {
+    channel->enabled = state;
+}
+inline void DMA_ITConfig(DMA_Channel_TypeDef *channel, uint32_t interrupts, FunctionalState state) {
+    if (interrupts & DMA_IT_TC) {
+        channel->tc_interrupt = state;
+    }
+}
+inline ITStatus DMA_GetITStatus(uint32_t interrupt) {
+    return mock::dma1_flags & interrupt ? SET : RESET;
+}
+// Clearing the global flag of a channel (GLx) clears all of its flags
+inline void DMA_ClearITPendingBit(uint32_t interrupt) {
+    for (unsigned int i = 0; i < 7; i ++) {
+        if (interrupt & 1u << (i * 4)) {
+            interrupt |= 0xFu << (i * 4);
+        }
+    }
+    mock::dma1_flags &= ~interrupt;
+}
@@ -0,0 +1,239 @@
+#include "st7920sim.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+#include "delay.h"
+#include "lcdbase.h"
+
+namespace mock {
+    static_assert(sizeof(GPIO_TypeDef) <= GPIOB_BASE - GPIOA_BASE, "A mock port must fit in its register block");
+
+    // Map the ports at their addresses before any other initialization can touch them
+    __attribute__((constructor(101))) static void map_gpio_ports() {
+        const uintptr_t start = GPIOA_BASE & ~0xFFFu;
+        const size_t size = GPIOA_BASE - start + GPIO_PORT_COUNT * (GPIOB_BASE - GPIOA_BASE);
+        void *block = mmap(reinterpret_cast<void *>(start), size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (block != reinterpret_cast<void *>(start)) {
+            std::fprintf(stderr, "Cannot map the mock GPIO ports at %#lx\n", static_cast<unsigned long>(start));
+            std::abort();
+        }
+        for (unsigned int i = 0; i < GPIO_PORT_COUNT; i ++) {
+            new (&gpio_port(i)) GPIO_TypeDef();
+        }
+    }
+
+    uint64_t cycles = 0;
+
+    // The LCD the mock ports are connected to
+    static ST7920Sim *attached = nullptr;
+
+    void gpio_written(GPIO_TypeDef *) {
+        cycles += REGISTER_ACCESS_CYCLES;
+        if (attached) {
+            attached->pins_changed();
+        }
+    }
+
+    uint32_t gpio_input(const GPIO_TypeDef *port) {
+        cycles += REGISTER_ACCESS_CYCLES;
+        return attached ? attached->port_input(port) : port->ODR;
+    }
+} // namespace mock
+
+void GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init) {
+    uint32_t field = init->GPIO_Mode & 0x0F;
+    if (init->GPIO_Mode & 0x10) {
+        field |= init->GPIO_Speed;
+    }
+    for (unsigned int i = 0; i < 16; i ++) {
+        if (!(init->GPIO_Pin & 1 << i)) {
+            continue;
+        }
+        uint32_t &reg = i < 8 ? port->CRL : port->CRH;
+        reg = (reg & ~(0xFu << (i % 8 * 4))) | field << (i % 8 * 4);
+    }
+    if (init->GPIO_Mode == GPIO_Mode_IPU) {
+        port->BSRR = init->GPIO_Pin;
+    }
+    else if (init->GPIO_Mode == GPIO_Mode_IPD) {
+        port->BRR = init->GPIO_Pin;
+    }
+}
+
+void GPIO_WriteBit(GPIO_TypeDef *port, uint16_t pin, BitAction value) {
+    if (value) {
+        port->BSRR = pin;
+    }
+    else {
+        port->BRR = pin;
+    }
+}
+
+uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef *port, uint16_t pin) {
+    return port->IDR & pin ? Bit_SET : Bit_RESET;
+}
+
+ST7920Sim::ST7920Sim(GPIOPin RS, GPIOPin RW, GPIOPin E, const GPIOPin (&data)[8]) : RS(RS), RW(RW), E(E) {
+    std::copy(data, data + 8, data_pins);
+    mock::attached = this;
+}
+
+ST7920Sim::~ST7920Sim() {
+    if (mock::attached == this) {
+        mock::attached = nullptr;
+    }
+}
+
+bool ST7920Sim::output(const GPIOPin &pin) const {
+    return pin.port->ODR & pin.pin;
+}
+
+bool ST7920Sim::is_busy() const {
+    return mock::cycles < busy_until;
+}
+
+void ST7920Sim::pins_changed() {
+    if (bus_log) {
+        uint16_t state = output(RS) << 10 | output(RW) << 9 | output(E) << 8;
+        for (unsigned int bit = 0; bit < 8; bit ++) {
+            state |= output(data_pins[bit]) << bit;
+        }
+        if (bus_log->empty() || bus_log->back() != state) {
+            bus_log->push_back(state);
+        }
+    }
+    bool E_now = output(E);
+    // Writes are latched on the falling edge of E
+    if (last_E && !E_now && !output(RW)) {
+        uint8_t value = 0;
+        for (unsigned int bit = 0; bit < 8; bit ++) {
+            value |= output(data_pins[bit]) << bit;
+        }
+        execute(value, output(RS));
+    }
+    // Count a status read on the rising edge, when the controller puts it on the bus
+    if (!last_E && E_now && output(RW) && !output(RS)) {
+        stats.status_reads ++;
+        if (is_busy()) {
+            stats.busy_reads ++;
+        }
+    }
+    last_E = E_now;
+}
+
+uint32_t ST7920Sim::port_input(const GPIO_TypeDef *port) const {
+    uint32_t value = port->ODR;
+    // The controller only drives the data bus during a read
+    if (!output(E) || !output(RW)) {
+        return value;
+    }
+    uint8_t out = 0;
+    if (!output(RS)) {
+        out = (is_busy() ? 0x80 : 0x00) | (vertical & 0x7F);
+    }
+    for (unsigned int bit = 0; bit < 8; bit ++) {
+        if (data_pins[bit].port == port) {
+            value = out & 1 << bit ? value | data_pins[bit].pin : value & ~data_pins[bit].pin;
+        }
+    }
+    return value;
+}
+
+void ST7920Sim::execute(uint8_t value, bool data) {
+    if (is_busy()) {
+        stats.writes_while_busy ++;
+    }
+    if (write_log) {
+        write_log->push_back({ value, data });
+    }
+    if (data) {
+        stats.data ++;
+        if (extended && gdram_selected) {
+            write_gdram(value);
+        }
+    }
+    else {
+        stats.commands ++;
+        execute_command(value);
+    }
+    busy_until = mock::cycles + static_cast<uint64_t>(lcd::exec_time(value, data, extended)) * SYSCLK_FREQUENCY;
+}
+
+void ST7920Sim::execute_command(uint8_t cmd) {
+    // Function set is the same in both instruction sets
+    if ((cmd & 0xE0) == 0x20) {
+        extended = cmd & 0x04;
+        if (extended) {
+            graphics_on = cmd & 0x02;
+        }
+        vertical_set = false;
+        return;
+    }
+    if (!extended) {
+        if (cmd == 0x01) {
+            // Clear only affects DDRAM
+            gdram_selected = false;
+        }
+        else if (cmd & 0x80) {
+            // DDRAM address
+            gdram_selected = false;
+        }
+        vertical_set = false;
+        return;
+    }
+    if (cmd & 0x80) {
+        if (!vertical_set) {
+            vertical = cmd & 0x3F;
+            vertical_set = true;
+        }
+        else {
+            horizontal = cmd & 0x0F;
+            vertical_set = false;
+            low_byte = false;
+            gdram_selected = true;
+            wrapped = false;
+        }
+        return;
+    }
+    if ((cmd & 0xFE) == 0x02) {
+        scroll_selected = cmd & 0x01;
+    }
+    else if ((cmd & 0xC0) == 0x40 && scroll_selected) {
+        scroll = cmd & 0x3F;
+    }
+    vertical_set = false;
+}
+
+void ST7920Sim::write_gdram(uint8_t value) {
+    if (wrapped) {
+        stats.wrapped_writes ++;
+    }
+    gdram[vertical][horizontal * 2 + low_byte] = value;
+    if (low_byte) {
+        wrapped = horizontal == 15;
+        horizontal = (horizontal + 1) % 16;
+    }
+    low_byte = !low_byte;
+}
+
+const uint8_t* ST7920Sim::screen_row(unsigned int y) const {
+    // The bottom half of the screen is the second half of the same rows as the top half
+    // Both halves scroll through all 64 rows
+    return &gdram[(y % 32 + scroll) % 64][y >= 32 ? 16 : 0];
+}
+
+bool ST7920Sim::pixel(unsigned int x, unsigned int y) const {
+    return screen_row(y)[x / 8] & 0x80 >> x % 8;
+}
+
+void ST7920Sim::dump(std::ostream &out) const {
+    out << "P4\n128 64\n";
+    for (unsigned int y = 0; y < 64; y ++) {
+        out.write(reinterpret_cast<const char *>(screen_row(y)), 16);
+    }
+}
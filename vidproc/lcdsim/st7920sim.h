@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "gpiopin.h"
+
+/*
+ * Behavioural model of an ST7920 on the 8-bit parallel interface, attached to the mock GPIO ports.
+ *
+ * Writes are latched on the falling edge of E, and reads see the busy flag and address counter while E is high.
+ * Every instruction keeps the controller busy for its execution time, measured on the simulated clock (see
+ * mock/delay.h). Only what the driver uses is modelled: function set (including the extended instruction
+ * set and graphics display bits), clear, home, the GDRAM address, GDRAM writes with the horizontal
+ * address auto-incrementing after every two bytes, and the vertical scroll address. DDRAM writes are counted
+ * but otherwise ignored.
+ */
+class ST7920Sim {
+public:
+    struct Stats {
+        uint64_t commands = 0;
+        uint64_t data = 0;
+        // Reads of the busy flag, and how many of them found the controller busy
+        uint64_t status_reads = 0;
+        uint64_t busy_reads = 0;
+        // Writes that arrived before the previous instruction was done, which a real controller may drop
+        uint64_t writes_while_busy = 0;
+        // GDRAM writes after the horizontal address wrapped around past the end of a row
+        uint64_t wrapped_writes = 0;
+    };
+
+    // A write the controller executed
+    struct Write {
+        uint8_t value;
+        bool data;
+
+        bool operator==(const Write &other) const {
+            return value == other.value && data == other.data;
+        }
+    };
+
+    ST7920Sim(GPIOPin RS, GPIOPin RW, GPIOPin E, const GPIOPin (&data)[8]);
+    ~ST7920Sim();
+
+    // Append every write the controller executes to writes, and the state of the bus every time it changes to
+    // bus (RS, RW and E in bits 10-8, D7-D0 below), until they are set back to null
+    void set_logs(std::vector<Write> *writes, std::vector<uint16_t> *bus) {
+        write_log = writes;
+        bus_log = bus;
+    }
+
+    // Called by the mock GPIO layer
+    void pins_changed();
+    uint32_t port_input(const GPIO_TypeDef *port) const;
+
+    const Stats& get_stats() const {
+        return stats;
+    }
+
+    bool is_extended() const {
+        return extended;
+    }
+    bool is_graphics_on() const {
+        return graphics_on;
+    }
+
+    // Pixel at (x, y) of the graphics display
+    bool pixel(unsigned int x, unsigned int y) const;
+    // Write the graphics display as a binary PBM image
+    void dump(std::ostream &out) const;
+
+private:
+    GPIOPin RS, RW, E;
+    GPIOPin data_pins[8];
+    bool last_E = false;
+
+    bool extended = false;
+    bool graphics_on = false;
+    // The GDRAM address is set with two commands in a row, vertical first
+    bool vertical_set = false;
+    uint8_t vertical = 0;
+    uint8_t horizontal = 0;
+    // Writes go to the high byte of the current word first
+    bool low_byte = false;
+    bool gdram_selected = false;
+    bool wrapped = false;
+
+    // 64 rows of 16 words, high byte first; 32 of them are on screen, starting from the scroll address
+    uint8_t gdram[64][32] = {};
+    // Whether the extended "0x40 | address" command sets the scroll address rather than the IRAM address
+    bool scroll_selected = false;
+    uint8_t scroll = 0;
+
+    uint64_t busy_until = 0;
+    Stats stats;
+    std::vector<Write> *write_log = nullptr;
+    std::vector<uint16_t> *bus_log = nullptr;
+
+    bool output(const GPIOPin &pin) const;
+    bool is_busy() const;
+    void execute(uint8_t value, bool data);
+    void execute_command(uint8_t cmd);
+    void write_gdram(uint8_t value);
+    // GDRAM bytes shown on screen row y
+    const uint8_t* screen_row(unsigned int y) const;
+};
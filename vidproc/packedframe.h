@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+
+static_assert(SCREEN_HEIGHT <= 64, "A frame column must fit in a 64-bit word");
+
+// Number of set bits in a word
+inline unsigned int popcount(uint64_t word) {
+    return __builtin_popcountll(word);
+}
+
+// Number of clear bits below the lowest set bit; the word must not be zero
+inline unsigned int count_trailing_zeros(uint64_t word) {
+    return __builtin_ctzll(word);
+}
+
+// Mask with bits [start, end) set
+inline uint64_t bit_range(unsigned int start, unsigned int end) {
+    if (end <= start) {
+        return 0;
+    }
+    uint64_t mask = end - start >= 64 ? ~0ull : (1ull << (end - start)) - 1;
+    return mask << start;
+}
+
+/*
+ * A monochrome frame, packed into one 64-bit word per column.
+ *
+ * Bit y of column x is the pixel at (x, y), so scanning a column from LSB to MSB visits the pixels in the same
+ * x-outer, y-inner order as the bitstream. Bits past the frame height are always clear.
+ */
+struct PackedFrame {
+    unsigned int width = 0;
+    unsigned int height = 0;
+    uint64_t columns[SCREEN_WIDTH]{};
+
+    PackedFrame() = default;
+
+    bool get(unsigned int x, unsigned int y) const {
+        return columns[x] >> y & 1;
+    }
+
+    // Move the picture up by lines rows, or down if lines is negative
+    // The rows that nothing moves into keep what they had, the same as the decoder does
+    void scroll(int lines) {
+        const uint64_t all = bit_range(0, height);
+        for (unsigned int x = 0; x < width; x ++) {
+            uint64_t column = columns[x];
+            if (lines > 0) {
+                uint64_t moved = bit_range(0, height - lines);
+                columns[x] = (column >> lines & moved) | (column & all & ~moved);
+            }
+            else if (lines < 0) {
+                uint64_t moved = bit_range(-lines, height);
+                columns[x] = (column << -lines & moved) | (column & all & ~moved);
+            }
+        }
+    }
+
+    // Number of pixels that differ from another frame of the same size
+    size_t difference(const PackedFrame &other) const {
+        size_t count = 0;
+        for (unsigned int x = 0; x < width; x ++) {
+            count += popcount(columns[x] ^ other.columns[x]);
+        }
+        return count;
+    }
+
+    // Copy the region [x0, x1) x [y0, y1) from another frame of the same size
+    void copy_region(const PackedFrame &from, unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+        uint64_t mask = bit_range(y0, y1);
+        for (unsigned int x = x0; x < x1; x ++) {
+            columns[x] = (columns[x] & ~mask) | (from.columns[x] & mask);
+        }
+    }
+};
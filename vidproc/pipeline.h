@@ -0,0 +1,165 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <utility>
+
+// Blocking FIFO queue with a fixed capacity, used to connect pipeline stages.
+// Producers block while the queue is full, so memory stays flat no matter how far ahead a stage gets.
+template <typename T>
+class BoundedQueue {
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed = false;
+
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    // Add an item, blocking while the queue is full
+    // Returns false if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Remove an item, blocking while the queue is empty
+    // Returns false once the queue is closed and there is nothing left
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Stop accepting items and wake everyone up
+    // Items already in the queue can still be popped
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+// Queue that hands out items in sequence order, no matter what order they are pushed in.
+// A producer blocks while its item is capacity or more ahead of the next one to be popped.
+// The item that is next in sequence can always be pushed, so this never deadlocks.
+template <typename T>
+class ReorderQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    std::map<size_t, T> items;
+    const size_t capacity;
+    size_t next = 0;
+    size_t end = std::numeric_limits<size_t>::max();
+    bool closed = false;
+
+public:
+    ReorderQueue(size_t capacity) : capacity(capacity) {}
+
+    // Add the item with the specified sequence number
+    // Returns false if the queue was closed
+    bool push(size_t index, T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this, index] { return closed || index < next + capacity; });
+        if (closed) {
+            return false;
+        }
+        items.emplace(index, std::move(item));
+        if (index == next) {
+            ready.notify_one();
+        }
+        return true;
+    }
+
+    // Remove the next item in sequence, blocking until it is available
+    // Returns false once every item up to the end has been popped, or if the queue was closed
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return closed || next >= end || items.count(next); });
+        auto it = items.find(next);
+        if (it == items.end()) {
+            return false;
+        }
+        item = std::move(it->second);
+        items.erase(it);
+        next ++;
+        space.notify_all();
+        return true;
+    }
+
+    // Set the total number of items that will be pushed
+    void finish(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        end = count;
+        ready.notify_all();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        ready.notify_all();
+        space.notify_all();
+    }
+};
+
+// Busy time and item count of one pipeline stage, for throughput reporting.
+// Only the time spent doing work is counted; time spent blocked on a queue is not.
+class StageTimer {
+    std::mutex mutex;
+    std::chrono::steady_clock::duration busy{};
+    size_t count = 0;
+
+public:
+    class Scope {
+        StageTimer &timer;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Scope(StageTimer &timer) : timer(timer), start(std::chrono::steady_clock::now()) {}
+
+        ~Scope() {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            std::lock_guard<std::mutex> lock(timer.mutex);
+            timer.busy += elapsed;
+            timer.count ++;
+        }
+    };
+
+    size_t items() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+    double busy_seconds() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::chrono::duration<double>(busy).count();
+    }
+
+    // Items processed per second of busy time
+    double throughput() {
+        double seconds = busy_seconds();
+        return seconds > 0 ? items() / seconds : 0;
+    }
+};
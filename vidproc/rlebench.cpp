@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "encoder.h"
+
+/*
+ * Times RunLengthEncoder on whole frames, fed one bit at a time through encode() (what the encoder did before
+ * encode_bits()) and a column at a time through encode_bits(), and reports the time per frame of each.
+ *
+ * Usage: rlebench [frames]
+ */
+
+namespace {
+
+    typedef std::vector<PackedFrame> Frames;
+
+    // Silhouettes like the target video: a few big blobs moving around, so runs are tens of pixels long
+    Frames silhouette_frames(unsigned int count) {
+        Frames frames(count);
+        for (unsigned int t = 0; t < count; t ++) {
+            PackedFrame &frame = frames[t];
+            frame.width = SCREEN_WIDTH;
+            frame.height = SCREEN_HEIGHT;
+            for (int x = 0; x < static_cast<int>(SCREEN_WIDTH); x ++) {
+                for (int y = 0; y < static_cast<int>(SCREEN_HEIGHT); y ++) {
+                    int dx = x - static_cast<int>(t % 160) + 16, dy = y - 40;
+                    int ex = x - 90 + static_cast<int>(t % 50), ey = y - static_cast<int>(t % 64);
+                    bool on = dx * dx + dy * dy * 3 < 600 || ex * ex * 2 + ey * ey < 300 || y > 56 - x / 32;
+                    frame.columns[x] |= static_cast<uint64_t>(on) << y;
+                }
+            }
+        }
+        return frames;
+    }
+
+    // Fine detail: short runs of a few pixels
+    Frames detailed_frames(unsigned int count) {
+        Frames frames(count);
+        std::mt19937_64 random(1);
+        for (PackedFrame &frame : frames) {
+            frame.width = SCREEN_WIDTH;
+            frame.height = SCREEN_HEIGHT;
+            for (uint64_t &column : frame.columns) {
+                column = random() & random();
+            }
+        }
+        return frames;
+    }
+
+    // Best time per frame over a number of passes, in microseconds
+    template <typename Encode>
+    double time_per_frame(const Frames &frames, Encode encode) {
+        double best = 1e9;
+        size_t tokens = 0;
+        for (int pass = 0; pass < 20; pass ++) {
+            auto start = std::chrono::steady_clock::now();
+            for (const PackedFrame &frame : frames) {
+                TokenStream stream;
+                {
+                    RunLengthEncoder encoder(stream);
+                    for (unsigned int x = 0; x < frame.width; x ++) {
+                        encode(encoder, frame, x);
+                    }
+                }
+                tokens += stream.items().size();
+            }
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count() / frames.size());
+        }
+        // Keep the work from being optimized away
+        if (!tokens) {
+            std::printf("No tokens written\n");
+        }
+        return best;
+    }
+
+    void bench(const char *name, const Frames &frames) {
+        typedef RunLengthEncoder Encoder;
+        double per_bit = time_per_frame(frames, [](Encoder &encoder, const PackedFrame &frame, unsigned int x) {
+            for (unsigned int y = 0; y < frame.height; y ++) {
+                encoder.encode(frame.get(x, y));
+            }
+        });
+        double per_word = time_per_frame(frames, [](Encoder &encoder, const PackedFrame &frame, unsigned int x) {
+            encoder.encode_bits(frame.columns[x], frame.height);
+        });
+        std::printf("%-12s per bit %7.2f us/frame, encode_bits %7.2f us/frame (%.2fx)\n",
+                name, per_bit, per_word, per_bit / per_word);
+    }
+} // namespace
+
+int main(int argc, char **argv) {
+    unsigned int count = argc > 1 ? std::atoi(argv[1]) : 400;
+    if (!count) {
+        std::fprintf(stderr, "Usage: rlebench [frames]\n");
+        return 1;
+    }
+    bench("silhouette", silhouette_frames(count));
+    bench("detailed", detailed_frames(count));
+    return 0;
+}
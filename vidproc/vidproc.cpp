@@ -1,115 +1,98 @@
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <queue>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/videoio.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
 #include "common.h"
-
-// Util class for writing individual bits
-class BitStream {
-    std::ostream &stream;
-    uint8_t buf;
-    int count;
-
-public:
-    BitStream(std::ostream &stream) : stream(stream), buf(0), count(0) {}
-
-    ~BitStream() {
-        stream.put(buf << (8 - count));
-    }
-
-    void write(bool bit) {
-        buf = (buf << 1) | bit;
-        if (++count == 8) {
-            stream.put(buf);
-            buf = count = 0;
+#include "packedframe.h"
+#include "pipeline.h"
+#include "encoder.h"
+
+// Util class for sampling frames from a video at a fixed rate.
+//
+// The source is decoded strictly in order and never seeked. For every output frame, the source frame whose
+// presentation timestamp is closest to the target time is picked; this matches what seeking with
+// CAP_PROP_POS_MSEC selects on constant frame rate inputs (round(t * fps) with ties going to the later frame),
+// without paying for a container seek and GOP re-decode every frame.
+//
+// Every frame handed out has its own buffer, so it can be passed to another thread while the next one is read.
+class FrameSampler {
+    cv::VideoCapture &cap;
+    cv::Mat current;
+    // Duration of one source frame in ms, or 0 if unknown
+    double source_interval;
+    // Timestamps of the last two grabbed frames, or negative values if they haven't been grabbed yet
+    double grabbed_msec;
+    double previous_msec;
+    bool retrieved;
+
+    // Slack for timestamps that are exactly halfway between two frames, so ties go to the later one even after
+    // rounding (e.g. 20733.33 + 16.67 at a target of 20750)
+    static constexpr double TIE_MSEC = 1e-3;
+
+    // Whether the frame after the current one is at least as close to the target time
+    bool is_behind(double target_msec) const {
+        if (grabbed_msec < 0) {
+            return true;
         }
-    }
-
-    BitStream& operator<<(bool bit) {
-        write(bit);
-        return *this;
-    }
-};
-
-// Util class for run-length encoding bits and writing to a stream.
-class RunLengthEncoder {
-    BitStream &stream;
-    bool val;
-    int repeat;
-
-private:
-    static constexpr int GROUP_SIZE = 3;
-    static const int OFFSETS[];
-
-    void flush() {
-        if (repeat < 1) {
-            return;
-        }
-
-		//std::cout << "encoding " << repeat << "\n";
-        // A repeat of zero is not possible, so everything is offset by 1
-        repeat --;
-        // Calculate the number of bits needed
-        int groups;
-        // Keep increasing the group count
-        // while the repeat count is still greater than the limit of the NEXT group count
-        for (groups = 1; repeat >= OFFSETS[groups]; groups ++);
-        // Subtract the correct offset
-        repeat -= OFFSETS[groups - 1];
-        // Write the bits
-        for (int i = 0; i < groups - 1; i ++) {
-            stream << 1;
-        }
-        stream << 0;
-        int mask = 1 << (groups * GROUP_SIZE);
-        while (mask >>= 1) {
-            stream << (repeat & mask);
+        // Without a known framerate, assume the next frame is as far away as the last one was
+        double interval = source_interval > 0 ? source_interval
+                : previous_msec >= 0 ? grabbed_msec - previous_msec : 0;
+        // Until then there is nothing to compare with; only move on if the current frame is before the target
+        if (interval <= 0) {
+            return grabbed_msec < target_msec;
         }
-
-        // Flip current value and reset counter
-        repeat = 0;
-        val = !val;
+        return grabbed_msec + interval / 2 <= target_msec + TIE_MSEC;
     }
 
 public:
-    RunLengthEncoder(BitStream &stream) : stream(stream), val(false), repeat(-1) {}
-
-    ~RunLengthEncoder() {
-        flush();
-		//std::cout << "rle over\n";
+    FrameSampler(cv::VideoCapture &cap) : cap(cap), grabbed_msec(-1), previous_msec(-1), retrieved(false) {
+        double fps = cap.get(cv::CAP_PROP_FPS);
+        source_interval = fps > 0 ? 1000 / fps : 0;
     }
 
-    void encode(bool bit) {
-        // Starting value not set -- write it
-        if (repeat == -1) {
-            stream << bit;
-            val = bit;
-            repeat = 1;
+    // Read the source frame that should be displayed at the specified time
+    // Returns false if the source has no frames left
+    bool read(cv::Mat &frame, double target_msec) {
+        // Skip (without converting) until the target time is closer to the current frame than the next one
+        // The current frame is reused if the source framerate is lower than the output framerate
+        while (is_behind(target_msec)) {
+            if (!cap.grab()) {
+                return false;
+            }
+            previous_msec = grabbed_msec;
+            grabbed_msec = cap.get(cv::CAP_PROP_POS_MSEC);
+            retrieved = false;
         }
-        else {
-            if (bit != val) {
-                flush();
+        if (!retrieved) {
+            // Release first so retrieve() allocates a new buffer instead of overwriting one handed out earlier
+            current.release();
+            if (!cap.retrieve(current)) {
+                return false;
             }
-            repeat ++;
+            retrieved = true;
         }
+        frame = current;
+        return true;
     }
-
-    RunLengthEncoder& operator<<(bool bit) {
-        encode(bit);
-        return *this;
-    }
-};
-
-const int RunLengthEncoder::OFFSETS[] = {
-    0, 8, 72, 584, 4680, 37448
 };
 
 /*
@@ -129,171 +112,310 @@ void process_frame(cv::Mat &in, cv::Mat &out) {
 }
 
 /*
- * Compress & encode the video and write to the stream.
- *
- * This method divides the frame into regions.
+ * Pack a thresholded 8-bit frame; non-zero pixels are set.
  */
-void encode_video(cv::VideoCapture &cap, std::ostream &out, int frame_limit = std::numeric_limits<int>::max()) {
-    cv::Mat frame;
-    cv::Mat processed;
-    cv::Mat previous;
-    // First frame is special
-    cap.set(cv::CAP_PROP_POS_MSEC, 0);
-    if (!cap.read(frame)) {
-        std::cerr << "Cannot encode video: Nothing to read\n";
-        return;
+PackedFrame pack_frame(const cv::Mat &frame) {
+    PackedFrame packed;
+    packed.width = frame.cols;
+    packed.height = frame.rows;
+    for (unsigned int y = 0; y < packed.height; y ++) {
+        const uint8_t *row = frame.ptr<uint8_t>(y);
+        for (unsigned int x = 0; x < packed.width; x ++) {
+            packed.columns[x] |= static_cast<uint64_t>(row[x] != 0) << y;
+        }
     }
-    process_frame(frame, processed);
-    // Write frame size
-    const unsigned int fwidth = processed.cols;
-    const unsigned int fheight = processed.rows;
-    out.put(fwidth);
-    out.put(fheight);
-    // Find the chunk size
-    // Divide and round up; the right & bottom chunks are a little smaller
-    // Makes the code a little cleaner later on
-    const unsigned int CHUNK_WIDTH = (fwidth - 1) / CHUNK_COUNT_X + 1;
-    const unsigned int CHUNK_HEIGHT = (fheight - 1) / CHUNK_COUNT_Y + 1;
+    return packed;
+}
 
-#define CHUNK_FOR(cx, cy) (cx * CHUNK_COUNT_Y + cy)
+/*
+ * Runs frame capture and preprocessing on worker threads, ahead of the encoder.
+ *
+ * One thread reads frames from the source, a pool of workers runs process_frame on them, and the processed
+ * frames are handed to the encoder in their original order. All the queues in between are bounded, so only
+ * a few frames are in flight at any time.
+ */
+class FramePipeline {
+    struct CapturedFrame {
+        size_t index;
+        cv::Mat image;
+    };
+
+    cv::VideoCapture &cap;
+    const size_t frame_limit;
+    // Time between output frames in ms
+    const unsigned int frame_interval;
+
+    BoundedQueue<CapturedFrame> captured;
+    ReorderQueue<PackedFrame> processed;
+
+    StageTimer capture_timer;
+    StageTimer process_timer;
+    std::atomic<bool> limit_reached{false};
+
+    std::thread capture_thread;
+    std::vector<std::thread> workers;
+
+    void capture() {
+        FrameSampler sampler(cap);
+        size_t index;
+        for (index = 0; ; index ++) {
+            // Hard stop for debugging purposes
+            if (index > frame_limit) {
+                limit_reached = true;
+                break;
+            }
 
-    BitStream out_bits(out);
-    // Run-length encode first frame
-    {
-        RunLengthEncoder encoder(out_bits);
-        for (unsigned int x = 0; x < fwidth; x ++) {
-            for (unsigned int y = 0; y < fheight; y ++) {
-				encoder << static_cast<bool>(processed.at<uint8_t>(y, x));
-			}
-		}
+            CapturedFrame frame{index, cv::Mat()};
+            bool success;
+            {
+                StageTimer::Scope scope(capture_timer);
+#ifdef SEEK_SAMPLING
+                // Old sampling path (seeks for every frame); kept around for benchmarking against the sampler
+                cap.set(cv::CAP_PROP_POS_MSEC, index * frame_interval);
+                success = cap.read(frame.image);
+#else
+                success = sampler.read(frame.image, index * frame_interval);
+#endif
+            }
+            if (!success || !captured.push(std::move(frame))) {
+                break;
+            }
+        }
+        processed.finish(index);
+        captured.close();
     }
 
-	// Keep track of how long we've "delayed" frame changes by
-	size_t accumulated_chunk_error[CHUNK_COUNT]{};
-	size_t total_frames_err = 0;
-
-    // Keep track of previous frame to do frame diffs
-    previous = processed;
-	size_t count;
-    for (count = 1; ; count ++) {
-        // Hard stop for debugging purposes
-        if (count > frame_limit) {
-            std::cout << "Frame limit reached.\n";
-			goto calculate_stats;
+    void preprocess() {
+        CapturedFrame frame;
+        while (captured.pop(frame)) {
+            cv::Mat out;
+            {
+                StageTimer::Scope scope(process_timer);
+                process_frame(frame.image, out);
+            }
+            // Packing is left out of the stage timer; it is negligible next to the resize
+            if (!processed.push(frame.index, pack_frame(out))) {
+                return;
+            }
         }
+    }
 
-        if (count % 50 == 0) {
-            std::cout << "Encoded " << (static_cast<double>(count) / FRAMERATE) << " seconds\n";
+public:
+    FramePipeline(cv::VideoCapture &cap, size_t frame_limit, unsigned int framerate, size_t worker_count)
+            : cap(cap), frame_limit(frame_limit), frame_interval(1000 / framerate), captured(worker_count * 2),
+            processed(worker_count * 2) {
+        capture_thread = std::thread(&FramePipeline::capture, this);
+        for (size_t i = 0; i < worker_count; i ++) {
+            workers.emplace_back(&FramePipeline::preprocess, this);
         }
+    }
 
-        cap.set(cv::CAP_PROP_POS_MSEC, count * FRAME_INTERVAL);
-        if (!cap.read(frame)) {
-            std::cout << "All frames read.\n";
-			goto calculate_stats;
+    ~FramePipeline() {
+        captured.close();
+        processed.close();
+        capture_thread.join();
+        for (auto &worker : workers) {
+            worker.join();
         }
-        process_frame(frame, processed);
+    }
 
-        // Find the chunks that changed
-        uint64_t mask = 1;
-        uint64_t changed_chunks = 0;
-		size_t   overall_frame_err = 0; // for stats
-        for (unsigned int cx = 0; cx < CHUNK_COUNT_X; cx ++) {
-            for (unsigned int cy = 0; cy < CHUNK_COUNT_Y; cy ++) {
-				unsigned int cxend = std::min((cx + 1) * CHUNK_WIDTH, fwidth);
-				unsigned int cyend = std::min((cy + 1) * CHUNK_HEIGHT, fheight);
-				bool allsame = true, check = static_cast<bool>(processed.at<uint8_t>(cy * CHUNK_HEIGHT, cx * CHUNK_WIDTH));
-				size_t chunk_error = 0;
-                for (unsigned int x = cx * CHUNK_WIDTH; x < cxend; x ++) {
-                    for (unsigned int y = cy * CHUNK_HEIGHT; y < cyend; y ++) {
-						bool cur = static_cast<bool>(processed.at<uint8_t>(y, x));
-                        if (cur != static_cast<bool>(previous.at<uint8_t>(y, x))) {
-							++chunk_error;
-                        }
-						if (cur != check) allsame = false;
-                    }
-                }
-				accumulated_chunk_error[CHUNK_FOR(cx, cy)] += chunk_error;
-				if (allsame && accumulated_chunk_error[CHUNK_FOR(cx, cy)]) accumulated_chunk_error[CHUNK_FOR(cx, cy)] += FRAME_CONST_FACTOR;
-				if (accumulated_chunk_error[CHUNK_FOR(cx, cy)] > (CHUNK_WIDTH * CHUNK_HEIGHT * FRAME_DIFF_PCT) / 100) {
-					accumulated_chunk_error[CHUNK_FOR(cx, cy)] = 0;
-					changed_chunks |= mask;
-					// update previous
-					cv::Rect roi{cv::Point(cx * CHUNK_WIDTH, cy * CHUNK_HEIGHT), cv::Point(cxend, cyend)};
-					processed(roi).copyTo(previous(roi));
-				}
-				else {
-					overall_frame_err += chunk_error;
-				}
-                mask <<= 1;
-            }
-        }
+    // Get the next processed and packed frame, in order
+    // Returns false once there are no frames left
+    bool next(PackedFrame &frame) {
+        return processed.pop(frame);
+    }
 
-		total_frames_err += overall_frame_err;
-		//std::cout << "using mask " << changed_chunks << std::endl;
+    // Whether the frames ran out because of the frame limit instead of the end of the source
+    bool reached_limit() const {
+        return limit_reached;
+    }
 
-        // Write frame header
-        for (unsigned int i = 0; i < CHUNK_COUNT; i ++) {
-            out_bits << ((changed_chunks & (1ull << (
-				CHUNK_COUNT - i - 1
-			))) != 0);
-        }
+    // Print the throughput of every stage, including the encoder stage timed by the caller
+    // The encoder stage's timer is shared by encode_workers threads
+    void print_stats(StageTimer &encode_timer, size_t encode_workers = 1) {
+        double process_rate = process_timer.throughput();
+        std::cout << "capture throughput (frames/s): " << capture_timer.throughput() << "\n";
+        std::cout << "preprocess throughput (frames/s): " << process_rate * workers.size()
+                << " (" << workers.size() << " workers at " << process_rate << ")\n";
+        double encode_rate = encode_timer.throughput();
+        std::cout << "encode throughput (frames/s): " << encode_rate * encode_workers
+                << " (" << encode_workers << " workers at " << encode_rate << ")\n";
+    }
+};
 
-		// If unchanged, don't encode frame
-		if (changed_chunks) {
-			// Encode the frame, skipping unchanged chunks
-			RunLengthEncoder encoder(out_bits);
-			for (unsigned int x = 0; x < fwidth; x ++) {
-				for (unsigned int y = 0; y < fheight; y ++) {
-					// Entered new chunk
-					if (y % CHUNK_HEIGHT == 0) {
-						unsigned int cx = std::min(x / CHUNK_WIDTH, CHUNK_COUNT_X - 1);
-						unsigned int cy = std::min(y / CHUNK_HEIGHT, CHUNK_COUNT_Y - 1);
-						// Check that the chunk is changed
-						if (!(changed_chunks & (1ull << (CHUNK_FOR(cx, cy))))) {
-							// Skip chunk if unchanged
-							// Offset 1 for the loop
-							y += CHUNK_HEIGHT - 1;
-							continue;
-						}
-					}
-					encoder << static_cast<bool>(processed.at<uint8_t>(y, x));
-				}
-			}
-		}
+/*
+ * Compress & encode the video and write to the stream.
+ *
+ * Frames are captured and preprocessed by a FramePipeline and encoded by encode_frames(), which takes the codec
+ * parameters from format.
+ */
+void encode_video(cv::VideoCapture &cap, std::ostream &out, const video::Header &format,
+        int frame_limit = std::numeric_limits<int>::max(),
+        size_t encode_workers = SegmentEncoder::default_worker_count()) {
+    auto start_time = std::chrono::steady_clock::now();
+    // Capture and preprocessing run on their own threads; this thread only splits the frames into segments
+    // The preprocessing workers get what the segment encoders leave of the worker budget
+    size_t budget = worker_budget();
+    FramePipeline pipeline(cap, frame_limit, format.framerate,
+            budget > encode_workers ? budget - encode_workers : 1);
+    StageTimer encode_timer;
+    EncodeStats stats;
+    if (!encode_frames([&](PackedFrame &frame) {
+        return pipeline.next(frame);
+    }, out, format, encode_timer, stats, encode_workers)) {
+        return;
+    }
+    if (pipeline.reached_limit()) {
+        std::cout << "Frame limit reached.\n";
+    }
+    else {
+        std::cout << "All frames read.\n";
     }
-#undef CHUNK_FOR
 
-calculate_stats:
 	// Calculate stats:
 	
-	std::cout << "total frame error (pixels): " << total_frames_err << "\n";
-	double avg_frame_err = (double)total_frames_err / count;
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	const size_t count = stats.frame_count;
+	pipeline.print_stats(encode_timer, encode_workers);
+	std::cout << "encoding time (s): " << elapsed.count() << " (" << (count / elapsed.count()) << " frames/s)\n";
+	std::cout << "total frame error (pixels): " << stats.frame_error << "\n";
+	double avg_frame_err = (double)stats.frame_error / count;
 	std::cout << "average frame error (pixels): " << avg_frame_err << "\n";
 	avg_frame_err *= 100;
-	avg_frame_err /= (fwidth * fheight);
+	avg_frame_err /= (stats.width * stats.height);
 	std::cout << "average frame error (pct): " << avg_frame_err << "\n";
+	std::cout << "scrolled frames: " << stats.scrolled_frames << "\n";
+	std::cout << "keyframes (segments): " << stats.keyframes << "\n";
+	std::cout << "video data (bytes): " << stats.data_size << " ("
+			<< static_cast<double>(stats.data_size) / count << " per frame)\n";
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    // Options can go anywhere; everything else is positional
+    video::Header format = video::DEFAULT_HEADER;
+    // Keyframes every KEYFRAME_SECONDS unless set
+    int keyframe_interval = -1;
+    // No limit unless set
+    int max_segments = 0;
+    size_t encode_workers = SegmentEncoder::default_worker_count();
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i ++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            args.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << "\n";
+            return 1;
+        }
+        if (arg == "--codec") {
+            std::string codec = argv[++ i];
+            format.flags &= ~(video::HUFFMAN_RUNS | video::RANS_CODED);
+            if (codec == "huffman") {
+                format.flags |= video::HUFFMAN_RUNS;
+            }
+            else if (codec == "rans") {
+                format.flags |= video::RANS_CODED;
+            }
+            else if (codec != "grouped") {
+                std::cerr << "Unknown codec " << codec << "\n";
+                return 1;
+            }
+            continue;
+        }
+        int value = std::atoi(argv[++ i]);
+        // 0 turns keyframes off (except for the first frame); everything else needs at least 1
+        int min = arg == "--keyframe-interval" ? 0 : 1;
+        int max = arg == "--keyframe-interval" || arg == "--max-segments" ? 0xFFFF : 0xFF;
+        if (value < min || value > max) {
+            std::cerr << "Bad value for " << arg << "\n";
+            return 1;
+        }
+        if (arg == "--fps") {
+            format.framerate = value;
+        }
+        else if (arg == "--chunks-x") {
+            format.chunk_count_x = value;
+        }
+        else if (arg == "--chunks-y") {
+            format.chunk_count_y = value;
+        }
+        else if (arg == "--group-size") {
+            format.group_size = value;
+        }
+        else if (arg == "--keyframe-interval") {
+            keyframe_interval = value;
+        }
+        else if (arg == "--max-segments") {
+            max_segments = value;
+        }
+        else if (arg == "--encode-workers") {
+            encode_workers = value;
+        }
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    if (args.empty()) {
         std::cerr << "Please provide a filename.\n";
+        std::cerr << "Usage: vidproc <video> [output] [frame limit] [--fps n] [--chunks-x n] [--chunks-y n] "
+                "[--group-size n] [--keyframe-interval frames] [--max-segments n] [--encode-workers n] "
+                "[--codec grouped|huffman|rans]\n";
         return 1;
     }
-    std::cout << "Using file " << argv[1] << "\n";
-    std::string out_filename = argc > 2 ? argv[2] : "video.bin";
+    std::cout << "Using file " << args[0] << "\n";
+    std::string out_filename = args.size() > 1 ? args[1] : "video.bin";
     std::cout << "Outputting to file " << out_filename << " (pass command line argument to override)\n";
     int frame_limit = std::numeric_limits<int>::max();
-    if (argc > 3) {
-        frame_limit = std::atoi(argv[3]);
+    if (args.size() > 2) {
+        frame_limit = std::atoi(args[2].c_str());
         std::cout << "Only encoding the first " << frame_limit << " frames.\n";
     }
+    format.keyframe_interval = keyframe_interval >= 0 ? keyframe_interval
+            : std::min(format.framerate * KEYFRAME_SECONDS, 0xFFFFu);
+    std::cout << "Encoding at " << +format.framerate << " fps with " << +format.chunk_count_x << "x"
+            << +format.chunk_count_y << " chunks and ";
+    if (format.flags & video::HUFFMAN_RUNS) {
+        std::cout << "Huffman coded runs\n";
+    }
+    else if (format.flags & video::RANS_CODED) {
+        std::cout << "rANS coding\n";
+    }
+    else {
+        std::cout << "an RLE group size of " << +format.group_size << "\n";
+    }
 
     cv::VideoCapture cap;
-    if (!cap.open(argv[1], cv::CAP_ANY)) {
+    if (!cap.open(args[0], cv::CAP_ANY)) {
         std::cerr << "Can't open video source file.\n";
         return 1;
     }
 
+    // Every keyframe starts a segment, so capping the segments means spacing the keyframes out
+    // This needs the length of the video up front; it's estimated from the source, or taken from the frame limit
+    if (max_segments && format.keyframe_interval) {
+        double source_fps = cap.get(cv::CAP_PROP_FPS);
+        double source_frames = cap.get(cv::CAP_PROP_FRAME_COUNT);
+        double frames = source_fps > 0 && source_frames > 0 ? source_frames / source_fps * format.framerate : 0;
+        if (args.size() > 2) {
+            // Frames 0 to the limit are encoded
+            frames = frames > 0 ? std::min(frames, frame_limit + 1.0) : frame_limit + 1.0;
+        }
+        if (frames > 0) {
+            double interval = std::ceil(frames / max_segments);
+            if (interval > format.keyframe_interval) {
+                format.keyframe_interval = std::min(interval, 65535.0);
+            }
+        }
+        else {
+            std::cerr << "Can't tell the length of the video; not capping the segments\n";
+        }
+    }
+    std::cout << "Keyframe every " << format.keyframe_interval << " frames, encoding segments on "
+            << encode_workers << " threads\n";
+
     std::ofstream out_file;
     out_file.open(out_filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
     if (!out_file) {
@@ -301,6 +423,6 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    encode_video(cap, out_file, frame_limit);
+    encode_video(cap, out_file, format, frame_limit, encode_workers);
     std::cout << "Done.\n";
 }
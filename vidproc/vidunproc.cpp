@@ -1,12 +1,19 @@
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <fstream>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <type_traits>
+#include <vector>
 #include <stdint.h>
 
 #include "common.h"
+#ifdef FIRMWARE_DECODER
+#include "decoder.h"
+#include "gdramplan.h"
+#endif
 
 #define SHOW_UNCHANGED_REGIONS
 
@@ -23,6 +30,20 @@ struct bit_reader {
 		}
 		return result;
 	}
+
+	// Skip to the next byte boundary
+	void align() {
+		if (idx != 8) {
+			idx = 8;
+			val = from.get();
+		}
+	}
+
+	// Start again from wherever the stream is now, after seeking it
+	void restart() {
+		idx = 8;
+		val = from.get();
+	}
 private:
 	std::istream &from;
 	uint8_t val; size_t idx = 8;
@@ -36,22 +57,139 @@ size_t read_num(size_t length, bit_reader& from) {
 	return val;
 }
 
-size_t read_count(bit_reader& from) {
-	static const size_t OFFSETS[] = {
-		0, 8, 72, 584, 4680, 37448
-	};
-	static const size_t GROUP_SIZE = 3;
-
+size_t read_count(bit_reader& from, size_t group_size, const video::RepeatOffsets &offsets) {
 	size_t groups = 0;
 	do {
 		groups++;
 	} while (from() != 0);
 
-	size_t result = read_num(groups*GROUP_SIZE, from) + 
-		OFFSETS[groups - 1] + 1;
+	size_t result = read_num(groups*group_size, from) + 
+		offsets[groups - 1] + 1;
 	return result;
 }
 
+// Reads run lengths in the Huffman code from a header, one bit at a time (see HUFFMAN_RUNS)
+// The codes of each length are consecutive numbers, given to the symbols in order, so a code is found by reading
+// one more bit until it's within the range of codes of its length
+struct huffman_reader {
+	huffman_reader(const video::Header &format) {
+		for (uint8_t length = 1; length <= video::MAX_RUN_CODE_LENGTH; ++length) {
+			for (uint8_t symbol = 0; symbol < video::RUN_SYMBOLS; ++symbol) {
+				if (format.run_code_lengths[symbol] == length) {
+					counts[length]++;
+					symbols.push_back(symbol);
+				}
+			}
+		}
+	}
+
+	size_t operator()(bit_reader &from) const {
+		// First code of the current length, and where its symbol is
+		size_t code = 0, first = 0, index = 0;
+		for (uint8_t length = 1; length <= video::MAX_RUN_CODE_LENGTH; ++length) {
+			code |= from() ? 1 : 0;
+			if (code - first < counts[length]) {
+				uint8_t symbol = symbols[index + code - first];
+				return video::run_base(symbol) + read_num(video::run_extra_bits(symbol), from);
+			}
+			index += counts[length];
+			first = (first + counts[length]) << 1;
+			code <<= 1;
+		}
+		// Not a code; is_valid_run_code() lets a code have gaps
+		return 1;
+	}
+private:
+	size_t counts[video::MAX_RUN_CODE_LENGTH + 1] = {};
+	std::vector<uint8_t> symbols;
+};
+
+// Reads values from an rANS coded video (see RANS_CODED), a byte at a time
+// Run symbols are found by going through the slots of each in turn, instead of with a table like the firmware
+struct rans_reader {
+	rans_reader(const video::Header &format) : format(format) {}
+
+	// Start a new stream at a keyframe
+	void start(bit_reader &from) {
+		state = read_num(32, from);
+		last_mask = ~0ull;
+	}
+
+	bool bit(uint8_t model, bit_reader &from) {
+		const uint32_t zero = format.rans_bit_freqs[model];
+		const bool result = slot() >= zero;
+		advance(result ? zero : 0, result ? video::RANS_SCALE - zero : zero, from);
+		return result;
+	}
+
+	size_t raw(uint8_t count, bit_reader &from) {
+		const uint8_t shift = video::RANS_SCALE_BITS - count;
+		const size_t value = slot() >> shift;
+		advance(value << shift, 1 << shift, from);
+		return value;
+	}
+
+	size_t run(bit_reader &from) {
+		uint32_t start = 0;
+		uint8_t symbol = 0;
+		while (slot() >= start + format.rans_run_freqs[symbol]) {
+			start += format.rans_run_freqs[symbol++];
+		}
+		advance(start, format.rans_run_freqs[symbol], from);
+		return video::run_base(symbol) + raw(video::run_extra_bits(symbol), from);
+	}
+
+	uint64_t mask(unsigned int chunks, bit_reader &from) {
+		uint64_t result = 0;
+		for (unsigned int chunk = 0; chunk < chunks; ++chunk) {
+			const bool before = chunk && (result >> (chunk - 1) & 1);
+			if (bit(video::mask_bit_model(before, last_mask >> chunk & 1), from)) {
+				result |= 1ull << chunk;
+			}
+		}
+		last_mask = result;
+		return result;
+	}
+private:
+	uint32_t slot() const {
+		return state & (video::RANS_SCALE - 1);
+	}
+
+	void advance(uint32_t start, uint32_t freq, bit_reader &from) {
+		state = freq * (state >> video::RANS_SCALE_BITS) + slot() - start;
+		while (state < video::RANS_LOWER_BOUND) {
+			state = state << 8 | read_num(8, from);
+		}
+	}
+
+	const video::Header &format;
+	uint32_t state = 0;
+	uint64_t last_mask = 0;
+};
+
+// Frame to jump to when a key is pressed in the viewer, or -1 to carry on
+// a and d go back and forward SEEK_SECONDS, and 0-9 jump 0-90% of the way through the video
+long seek_target(int key, size_t frame, size_t frame_count, unsigned int framerate) {
+	static const long SEEK_SECONDS = 5;
+	if (!frame_count) {
+		return -1;
+	}
+	long target;
+	if (key == 'a') {
+		target = static_cast<long>(frame) - SEEK_SECONDS * framerate;
+	}
+	else if (key == 'd') {
+		target = frame + SEEK_SECONDS * framerate;
+	}
+	else if (key >= '0' && key <= '9') {
+		target = frame_count * (key - '0') / 10;
+	}
+	else {
+		return -1;
+	}
+	return std::max(0l, std::min(target, static_cast<long>(frame_count) - 1));
+}
+
 int main(int argc, char ** argv) {
 	if (argc < 2) {
 		std::cerr << "Please provide a filename.\n";
@@ -60,9 +198,100 @@ int main(int argc, char ** argv) {
 
 	std::ifstream in_file(argv[1], std::ios::binary);
 	
-	// Read the frame size
-	size_t width = in_file.get();
-	size_t height = in_file.get();
+#ifdef FIRMWARE_DECODER
+	// Play the video through the firmware's decoder instead, to check it against the decoder below
+	{
+		// The decoder reads whole words, so keep the data word aligned and padded
+		std::vector<char> bytes((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+		std::vector<uint32_t> words(bytes.size() / 4 + 1);
+		std::copy(bytes.begin(), bytes.end(), reinterpret_cast<char *>(words.data()));
+
+		VideoDecoder decoder(reinterpret_cast<const uint8_t *>(words.data()), bytes.size());
+		if (!decoder.is_supported()) {
+			std::cerr << "Unsupported video.\n";
+			return 1;
+		}
+		const unsigned int FRAME_INTERVAL = 1000 / decoder.get_header().framerate;
+		framebuf::Frame lcd_frame = {};
+		cv::Mat frame = cv::Mat(64, 128, CV_8UC1);
+		cv::Mat framescaled;
+
+		// Plan the LCD updates too, to count the bus writes with and without gap bridging
+		// Free commands make the planner set the address again for every gap
+		const lcd::BusCost NO_BRIDGING = { 0, 1 };
+		static lcd::GDRAMState display = {}, display_no_bridging = {};
+		uint8_t scroll = 0;
+		std::vector<lcd::BusWrite> writes(lcd::MAX_GDRAM_WRITES);
+		lcd::BusStats stats = {}, stats_no_bridging = {};
+		size_t frames = 0;
+		// Frames before this one are being skipped after a seek
+		uint32_t show_from = 0;
+		// Every word has to be compared after skipping frames
+		framebuf::DirtyMask all_dirty;
+		std::fill(std::begin(all_dirty), std::end(all_dirty), 0xFFFF);
+		bool seeked = false;
+		while (decoder.read_frame(lcd_frame)) {
+			scroll = (scroll + decoder.scrolled_lines()) & 63;
+			if (decoder.next_frame() <= show_from) {
+				continue;
+			}
+			const framebuf::DirtyMask &dirty = seeked ? all_dirty : decoder.changed_words();
+			seeked = false;
+			lcd::plan_gdram_update(lcd_frame, display, scroll, dirty, writes.data(), lcd::DEFAULT_BUS_COST, &stats);
+			lcd::plan_gdram_update(lcd_frame, display_no_bridging, scroll, dirty, writes.data(),
+				NO_BRIDGING, &stats_no_bridging);
+			frames++;
+
+			for (unsigned int y = 0; y < 64; ++y) {
+				for (unsigned int x = 0; x < 128; ++x) {
+					frame.at<uint8_t>(y, x) = *framebuf::pixel_byte(lcd_frame, x, y) & (0x80 >> x % 8) ? 0x00 : 0xff;
+				}
+			}
+			cv::resize(frame, framescaled, cv::Size(), 4, 4, cv::INTER_NEAREST);
+			cv::imshow("img", framescaled);
+			long target = seek_target(cv::waitKey(FRAME_INTERVAL), decoder.next_frame() - 1,
+				decoder.get_header().frame_count, decoder.get_header().framerate);
+			if (target >= 0 && decoder.seek(target)) {
+				show_from = target;
+				seeked = true;
+			}
+		}
+		auto print_stats = [&](const char *name, const lcd::BusStats &stats) {
+			std::cout << name << ": " << stats.commands << " commands, " << stats.data << " data writes, "
+				<< static_cast<double>(stats.commands + stats.data) / std::max<size_t>(frames, 1) << " writes/frame\n";
+		};
+		print_stats("With gap bridging", stats);
+		print_stats("Without gap bridging", stats_no_bridging);
+		return 0;
+	}
+#endif
+
+	// Read the header, then go back to where the bitstream starts
+	uint8_t header_bytes[video::MAX_HEADER_SIZE];
+	in_file.read(reinterpret_cast<char *>(header_bytes), sizeof(header_bytes));
+	video::Header format;
+	uint8_t header_size = video::read_header(header_bytes, in_file.gcount(), format);
+	if (!header_size || !video::is_supported(format)) {
+		std::cerr << "Unsupported video.\n";
+		return 1;
+	}
+	in_file.clear();
+	in_file.seekg(header_size);
+	size_t width = format.width;
+	size_t height = format.height;
+	const bool scroll_ops = format.flags & video::SCROLL_OPS;
+	const unsigned int CHUNK_COUNT_X = format.chunk_count_x;
+	const unsigned int CHUNK_COUNT_Y = format.chunk_count_y;
+	const unsigned int FRAME_INTERVAL = 1000 / format.framerate;
+	video::RepeatOffsets offsets;
+	video::repeat_offsets(format.group_size, offsets);
+	const huffman_reader read_huffman(format);
+	const bool rans_coded = format.flags & video::RANS_CODED;
+	rans_reader rans(format);
+	auto read_run = [&](bit_reader &from) {
+		return rans_coded ? rans.run(from)
+			: format.flags & video::HUFFMAN_RUNS ? read_huffman(from) : read_count(from, format.group_size, offsets);
+	};
 
 	// Setup a bit reader
 	bit_reader br(in_file);
@@ -72,6 +301,29 @@ int main(int argc, char ** argv) {
     const unsigned int CHUNK_HEIGHT = (height - 1) / CHUNK_COUNT_Y + 1;
 
 	std::cout << "h " << height << " w " << width << " ch " << CHUNK_HEIGHT << " cw " << CHUNK_WIDTH << "\n";
+	std::cout << "version " << +format.version << ", " << format.frame_count << " frames at " << +format.framerate
+		<< " fps\n";
+
+	// Read the keyframe index, if there is one
+	std::vector<uint32_t> index(format.index_offset ? video::keyframe_count(format) : 0);
+	if (!index.empty()) {
+		in_file.seekg(format.index_offset);
+		for (uint32_t &offset : index) {
+			uint8_t entry[video::INDEX_ENTRY_SIZE];
+			in_file.read(reinterpret_cast<char *>(entry), sizeof(entry));
+			offset = video::read_be(entry, sizeof(entry));
+		}
+		if (!in_file) {
+			std::cerr << "Keyframe index is cut off; seeking is disabled.\n";
+			index.clear();
+		}
+		in_file.clear();
+		in_file.seekg(header_size);
+		br.restart();
+	}
+	if (!index.empty()) {
+		std::cout << index.size() << " keyframes; a/d to seek 5 s, 0-9 to jump\n";
+	}
 
 	// Setup a buffer
 	cv::Mat frame = cv::Mat(height, width, CV_8UC1);
@@ -81,8 +333,8 @@ int main(int argc, char ** argv) {
 	auto read_frame = [&](size_t cmask){
 		if (!cmask) return;
 
-		bool current = br();
-		size_t repeat = read_count(br);
+		bool current = rans_coded ? rans.raw(1, br) : br();
+		size_t repeat = read_run(br);
 
 #ifdef SHOW_UNCHANGED_REGIONS
 		for (unsigned int x = 0; x < width; ++x) {
@@ -109,7 +361,7 @@ int main(int argc, char ** argv) {
 				if (!repeat) {
 					// update next
 					current = !current;
-					repeat = read_count(br);
+					repeat = read_run(br);
 				}
 				// Consume repeat
 				repeat--;
@@ -118,21 +370,56 @@ int main(int argc, char ** argv) {
 		}
 	};
 
-	// Read the first frame
-	read_frame(~0ull); // all chunks
-
-	// Show frame
-	cv::resize(frame, framescaled, cv::Size(), 4, 4, cv::INTER_NEAREST);
-	cv::imshow("img", framescaled);
-	// Wait
-	cv::waitKey(FRAME_INTERVAL);
-	// Show all frames
-	while (in_file) {
-		read_frame(read_num(CHUNK_COUNT_X * CHUNK_COUNT_Y, br));
+	// Move the frame up by lines rows (down if negative); rows nothing moves into are left alone
+	auto scroll_frame = [&](int lines) {
+		cv::Mat old = frame.clone();
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			int from = y + lines;
+			if (from >= 0 && from < static_cast<int>(height)) {
+				old.row(from).copyTo(frame.row(y));
+			}
+		}
+	};
+
+	// Show all frames, stopping at the frame count if the header has one
+	// Frames before show_from are decoded without being shown, to get there after a seek
+	size_t show_from = 0;
+	for (size_t frame_idx = 0; in_file && (!format.frame_count || frame_idx < format.frame_count); ++frame_idx) {
+		if (video::is_keyframe(format, frame_idx)) {
+			// Keyframes start on a byte boundary and have every chunk
+			br.align();
+			if (rans_coded) {
+				rans.start(br);
+			}
+			read_frame(~0ull);
+		}
+		else {
+			size_t cmask = rans_coded ? rans.mask(CHUNK_COUNT_X * CHUNK_COUNT_Y, br)
+				: read_num(CHUNK_COUNT_X * CHUNK_COUNT_Y, br);
+			if (scroll_ops && (rans_coded ? rans.bit(video::RANS_SCROLL_MODEL, br) : br())) {
+				// 7-bit two's complement
+				int lines = static_cast<int>(rans_coded ? rans.raw(7, br) : read_num(7, br));
+				scroll_frame(lines >= 64 ? lines - 128 : lines);
+			}
+			read_frame(cmask);
+		}
+		if (frame_idx < show_from) {
+			continue;
+		}
 		// Show frame
 		cv::resize(frame, framescaled, cv::Size(), 4, 4, cv::INTER_NEAREST);
 		cv::imshow("img", framescaled);
-		// Wait
-		cv::waitKey(FRAME_INTERVAL);
+		// Wait, and seek if a key was pressed
+		long target = seek_target(cv::waitKey(FRAME_INTERVAL), frame_idx, format.frame_count, format.framerate);
+		if (target >= 0 && !index.empty()) {
+			// Go to the keyframe before the target; the loop decodes the rest of the way
+			size_t keyframe = format.keyframe_interval ? target / format.keyframe_interval : 0;
+			in_file.clear();
+			in_file.seekg(index[keyframe]);
+			br.restart();
+			show_from = target;
+			// The loop increments this back to the keyframe
+			frame_idx = keyframe * format.keyframe_interval - 1;
+		}
 	}
 }